@@ -1,3 +1,5 @@
+import argparse
+import re
 import sys
 import os
 from dataclasses import dataclass
@@ -17,6 +19,21 @@ class Unspecified:
 
 Immediate = int | bool | Char | None | Unspecified
 
+
+@dataclass
+class Pair:
+    car: "Datum"
+    cdr: "Datum"
+
+
+@dataclass
+class Vector:
+    elements: list["Datum"]
+
+
+# What LOAD can load. Strings are bytes.
+Datum = Immediate | bytes | Pair | Vector
+
 CHAR_PREFIX: str = "#\\"
 
 
@@ -64,99 +81,536 @@ def serialize_immediate(v: Immediate) -> bytes:
     assert False
 
 
-DEFAULT_IMMEDIATE: bytes = 0x0.to_bytes(8, "little")
+@dataclass
+class Instruction:
+    opcode: int
+    # Left out of the bytecode when None
+    immediate: bytes | None = None  # (or several, concatenated)
+    # For jumps, how many instructions to skip. (-1 jumps to itself.) The
+    # offset goes after any immediates.
+    jump: int | None = None
+    # A constant for the data section. The instruction's last word is the
+    # offset to it, relative to the next instruction like a jump's.
+    data: bytes | None = None
+    # A list, vector or string for the data section. The instruction's last
+    # word is a pointer to it, which the launcher relocates.
+    datum: Datum | None = None
+
+    def size(self) -> int:
+        result: int = 8 + len(self.immediate or b"")
+        if self.jump is not None:
+            result += 8
+        if self.has_constant():
+            result += 8
+        return result
+
+    def has_constant(self) -> bool:
+        return self.data is not None or self.datum is not None
+
+
+# ASCII between double quotes, with \\, \" and \xNN escapes
+STRING_PATTERN: str = r'"((?:[^"\\]|\\["\\]|\\x[0-9a-fA-F]{2})*)"'
+ESCAPE_PATTERN: str = r'\\(["\\]|x[0-9a-fA-F]{2})'
+
+
+def unescape(escape: re.Match[str]) -> str:
+    escaped: str = escape.group(1)
+    return chr(int(escaped[1:], 16)) if escaped.startswith("x") else escaped
+
+
+def parse_string(s: str) -> bytes:
+    match = re.fullmatch(STRING_PATTERN, s)
+    if match is None or not s.isascii():
+        raise ValueError(f"Couldn't parse string constant {s}")
+    return re.sub(ESCAPE_PATTERN, unescape, match.group(1)).encode("latin-1")
+
+
+DATUM_TOKEN: re.Pattern[str] = re.compile(
+    r'\s*(#\\x[0-9a-fA-F]{2}|#\\.|#\(|[().]|"(?:[^"\\]|\\.)*"|[^\s()"]+)'
+)
+
+
+@dataclass
+class OpenList:
+    """A list or vector that parse_datum hasn't read the end of yet."""
+
+    elements: list[Datum]
+    vector: bool
+    # Whether a . has been read, and the datum after it if that has been too
+    dotted: bool = False
+    has_tail: bool = False
+    tail: Datum = None
+
+
+def parse_datum(s: str) -> Datum:
+    """Parses a datum in Scheme's syntax, as far as the interpreter has types
+    for it: immediates, strings, and lists (dotted or not) and vectors of
+    them."""
+    open_lists: list[OpenList] = []
+    result: list[Datum] = []
+
+    def add(datum: Datum) -> None:
+        if not open_lists:
+            result.append(datum)
+        elif not open_lists[-1].dotted:
+            open_lists[-1].elements.append(datum)
+        elif not open_lists[-1].has_tail:
+            open_lists[-1].tail = datum
+            open_lists[-1].has_tail = True
+        else:
+            raise ValueError(f"More than one datum after . in {s}")
+
+    position: int = 0
+    while s[position:].strip():
+        match = DATUM_TOKEN.match(s, position)
+        if match is None:
+            raise ValueError(f"Couldn't parse datum {s}")
+        position = match.end()
+        token: str = match.group(1)
+        if token in ("(", "#("):
+            open_lists.append(OpenList([], token == "#("))
+        elif token == ".":
+            if not open_lists or open_lists[-1].vector or open_lists[-1].dotted:
+                raise ValueError(f"Misplaced . in {s}")
+            if not open_lists[-1].elements:
+                raise ValueError(f"Misplaced . in {s}")
+            open_lists[-1].dotted = True
+        elif token == ")":
+            if not open_lists:
+                raise ValueError(f"Unbalanced ) in {s}")
+            closed: OpenList = open_lists.pop()
+            if closed.vector:
+                add(Vector(closed.elements))
+                continue
+            if closed.dotted and not closed.has_tail:
+                raise ValueError(f"Nothing after . in {s}")
+            datum: Datum = closed.tail
+            for element in reversed(closed.elements):
+                datum = Pair(element, datum)
+            add(datum)
+        elif token.startswith('"'):
+            add(parse_string(token))
+        else:
+            add(parse_immediate(token))
+    if open_lists or len(result) != 1:
+        raise ValueError(f"Couldn't parse datum {s}")
+    return result[0]
+
+
+def serialize_string(v: bytes) -> bytes:
+    """The string as it's laid out on the heap: a header, then its bytes."""
+    header: int = (len(v) << 4) | 0b0110
+    padding: bytes = bytes(-len(v) % 8)
+    return header.to_bytes(8, "little") + v + padding
+
+
+def parse_instruction(line: str, opcodes: dict[str, int]) -> Instruction:
+    opcode: int
+    immediate: bytes | None = None
+    jump: int | None = None
+    data: bytes | None = None
+    datum: Datum | None = None
+    # Everything after the mnemonic, for operands that can have spaces in them
+    operand: str = line.split(maxsplit=1)[1].strip() if len(line.split()) > 1 else ""
+    match line.split():
+        case ["STRINGLIT", *_]:
+            opcode = opcodes["stringlit"]
+            data = serialize_string(parse_string(operand))
+        case ["LOAD", *_] if operand.startswith(("(", "#(", '"')):
+            opcode = opcodes["load"]
+            value: Datum = parse_datum(operand)
+            if isinstance(value, (Pair, Vector, bytes)):
+                datum = value
+            else:
+                immediate = serialize_immediate(value)  # ()
+        case ["LOAD", v]:
+            opcode = opcodes["load"]
+            immediate = serialize_immediate(parse_immediate(v))
+        case ["JUMP", v]:
+            opcode = opcodes["jump"]
+            jump = int(v)
+        case ["CJUMP", v]:
+            opcode = opcodes["cjump"]
+            jump = int(v)
+        case ["BRANCH_IF_FALSE", v]:
+            opcode = opcodes["branchiffalse"]
+            jump = int(v)
+        case ["BRANCH_IF_NOT_LT", v]:
+            opcode = opcodes["branchifnotlt"]
+            jump = int(v)
+        case ["BRANCH_IF_NOT_EQ", v]:
+            opcode = opcodes["branchifnoteq"]
+            jump = int(v)
+        case ["BRANCH_IF_NOT_ZERO", v]:
+            opcode = opcodes["branchifnotzero"]
+            jump = int(v)
+        case ["BRANCH_IF_NOT_NULL", v]:
+            opcode = opcodes["branchifnotnull"]
+            jump = int(v)
+        case ["GET", v]:
+            opcode = opcodes["get"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["FORGET"]:
+            opcode = opcodes["forget"]
+        case ["ADD1"]:
+            opcode = opcodes["add1"]
+        case ["SUB1"]:
+            opcode = opcodes["sub1"]
+        case ["ADD", v]:
+            opcode = opcodes["add"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["SUB", v]:
+            opcode = opcodes["sub"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["MUL", v]:
+            opcode = opcodes["mul"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["LT", v]:
+            opcode = opcodes["lt"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["EQ", v]:
+            opcode = opcodes["eq"]
+            immediate = int(v).to_bytes(8, "little")
+        case [("ADD2" | "SUB2" | "MUL2" | "LT2" | "EQ2" | "EQP2") as mnemonic]:
+            opcode = opcodes[mnemonic.lower()]
+        case [("ADDI" | "SUBI" | "MULI" | "LTI" | "EQI") as mnemonic, v]:
+            opcode = opcodes[mnemonic.lower()]
+            k: Immediate = parse_immediate(v)
+            if not isinstance(k, int) or isinstance(k, bool):
+                raise ValueError(f"{mnemonic} needs an integer, not {v}")
+            immediate = serialize_immediate(k)
+        case ["EQP", v]:
+            opcode = opcodes["eqp"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["ZEROP"]:
+            opcode = opcodes["zerop"]
+        case ["STRING", v]:
+            opcode = opcodes["string"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["STRINGREF"]:
+            opcode = opcodes["stringref"]
+        case ["STRINGSET"]:
+            opcode = opcodes["stringset"]
+        case ["STRINGAPPEND", v]:
+            opcode = opcodes["stringappend"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["VECTOR", v]:
+            opcode = opcodes["vector"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["VECTORREF"]:
+            opcode = opcodes["vectorref"]
+        case ["VECTORSET"]:
+            opcode = opcodes["vectorset"]
+        case ["VECTORAPPEND", v]:
+            opcode = opcodes["vectorappend"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["INTEGERP"]:
+            opcode = opcodes["integerp"]
+        case ["BOOLEANP"]:
+            opcode = opcodes["booleanp"]
+        case ["CHARP"]:
+            opcode = opcodes["charp"]
+        case ["NULLP"]:
+            opcode = opcodes["nullp"]
+        case ["NOT"]:
+            opcode = opcodes["not"]
+        case ["INTTOCHAR"]:
+            opcode = opcodes["inttochar"]
+        case ["CHARTOINT"]:
+            opcode = opcodes["chartoint"]
+        case ["FALL", v]:
+            opcode = opcodes["fall"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["CONS"]:
+            opcode = opcodes["cons"]
+        case ["LIST", v]:
+            opcode = opcodes["list"]
+            immediate = int(v).to_bytes(8, "little")
+        case ["CAR"]:
+            opcode = opcodes["car"]
+        case ["CDR"]:
+            opcode = opcodes["cdr"]
+        case _:
+            raise ValueError(f"Couldn't parse line {line}")
+    return Instruction(opcode, immediate, jump, data, datum)
+
+
+ARITY_2: bytes = (2).to_bytes(8, "little")
+NULL_IMMEDIATE: bytes = serialize_immediate(None)
+
+
+def is_int_immediate(immediate: bytes) -> bool:
+    return int.from_bytes(immediate, "little") & 0b11 == 0
+
+
+def is_add2(handler: str, immediate: bytes | None) -> bool:
+    """Whether the instruction adds the top two values, in either form."""
+    return handler == "add2" or (handler == "add" and immediate == ARITY_2)
+
+
+# A generated superinstruction: its handler, and the handlers it fuses
+Generated = tuple[str, list[str]]
+
+
+def superinstruction(
+    window: list[tuple[str, bytes | None]], generated: list[Generated]
+) -> tuple[int, str, bytes | None] | None:
+    """If window (handler names and immediates) starts with a sequence that
+    has a superinstruction, returns how many instructions it replaces, its
+    handler, and its immediates."""
+    match window:
+        case [("get", bytes() as a), ("get", bytes() as b), (add, n), *_] if (
+            is_add2(add, n)
+        ):
+            return 3, "getgetadd", a + b
+        case [("load", bytes() as k), (add, n), *_] if (
+            is_add2(add, n) and is_int_immediate(k)
+        ):
+            # Not a superinstruction, just the instruction the compiler would
+            # emit for (+ x k)
+            return 2, "addi", k
+        case [("get", n), ("car", _), *_]:
+            return 2, "getcar", n
+        case [("load", k), ("cons", _), *_] if k == NULL_IMMEDIATE:
+            return 2, "loadnullcons", None
+        case [("forget", _), ("load", k), *_]:
+            return 2, "forgetload", k
+        case [("forget", _), ("get", n), *_]:
+            return 2, "forgetget", n
+    for name, sequence in generated:
+        if [handler for handler, _ in window[: len(sequence)]] == sequence:
+            immediates: bytes = b"".join(
+                immediate or b"" for _, immediate in window[: len(sequence)]
+            )
+            return len(sequence), name, immediates or None
+    return None
+
+
+# Wide enough for the longest hand-written sequence above
+SUPERINSTRUCTION_MAX_LENGTH: int = 3
+
+# Written by superinstructions.py
+GENERATED_PATH: str = os.path.join(
+    os.path.dirname(__file__), "superinstructions.txt"
+)
+
+
+def read_generated(path: str, opcodes: dict[str, int]) -> list[Generated]:
+    """Leaves out superinstructions that the interpreter wasn't built with."""
+    result: list[Generated] = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            name, *sequence = line.split()
+            if name in opcodes:
+                result.append((name, sequence))
+    return result
+
+
+def fuse_with_origins(
+    instructions: list[Instruction],
+    opcodes: dict[str, int],
+    generated: list[Generated],
+) -> tuple[list[Instruction], list[int]]:
+    """fuse, but also returns the index in instructions that each of the
+    fused instructions starts at."""
+    names: dict[int, str] = {opcode: name for name, opcode in opcodes.items()}
+    targets: set[int] = set()
+    for i, instruction in enumerate(instructions):
+        if instruction.jump is not None:
+            target: int = i + 1 + instruction.jump
+            if target < 0 or target >= len(instructions):
+                raise ValueError(f"Jump target {target} out of range")
+            targets.add(target)
+    window_length: int = max(
+        [SUPERINSTRUCTION_MAX_LENGTH] + [len(sequence) for _, sequence in generated]
+    )
+
+    result: list[Instruction] = []
+    origins: list[int] = []
+    # For each of the original instructions, where it ended up in result
+    new_index: list[int] = []
+    # Jumps in result, and their targets in instructions
+    jumps: list[tuple[int, int]] = []
+    i: int = 0
+    while i < len(instructions):
+        window: list[tuple[str, bytes | None]] = [
+            (names[instruction.opcode], instruction.immediate)
+            for instruction in instructions[i : i + window_length]
+        ]
+        length: int = 1
+        current: Instruction = instructions[i]
+        fused = superinstruction(window, generated)
+        # Only the last instruction of a sequence can jump, and nothing can
+        # jump into the middle of one. Superinstructions don't have constants.
+        if (
+            fused is not None
+            and targets.isdisjoint(range(i + 1, i + fused[0]))
+            and all(x.jump is None for x in instructions[i : i + fused[0] - 1])
+            and not any(x.has_constant() for x in instructions[i : i + fused[0]])
+        ):
+            length, name, immediate = fused
+            current = Instruction(
+                opcodes[name], immediate, instructions[i + length - 1].jump
+            )
+        if current.jump is not None:
+            jumps.append((len(result), i + length + current.jump))
+        new_index += [len(result)] * length
+        origins.append(i)
+        result.append(current)
+        i += length
+
+    for j, target in jumps:
+        result[j] = Instruction(
+            result[j].opcode, result[j].immediate, new_index[target] - (j + 1)
+        )
+    return result, origins
+
+
+def fuse(
+    instructions: list[Instruction],
+    opcodes: dict[str, int],
+    generated: list[Generated],
+) -> list[Instruction]:
+    """The peephole pass. Replaces sequences with their superinstructions,
+    unless something jumps into the middle of them, and fixes up the jumps."""
+    return fuse_with_origins(instructions, opcodes, generated)[0]
+
+
+class DataSection:
+    """The constants that follow the code. Each is laid out like the heap object
+    it stands for, with pointers as offsets from the start of the bytecode. The
+    launcher adds the bytecode's address to each word in relocations."""
+
+    def __init__(self, start: int) -> None:
+        # Where the data section starts in the bytecode
+        self.start: int = start
+        self.contents: bytearray = bytearray()
+        # Offsets of words in the bytecode
+        self.relocations: list[int] = []
+        # Constants without pointers in them only need to be added once
+        self.offsets: dict[bytes, int] = {}
+
+    def constant(self, serialized: bytes) -> int:
+        """Returns the offset of a constant that has no pointers in it."""
+        if serialized not in self.offsets:
+            self.offsets[serialized] = self.start + len(self.contents)
+            self.contents += serialized
+        return self.offsets[serialized]
+
+    def add_object(self, words: list[tuple[int, bool]]) -> int:
+        """Adds an object made of (word, whether it needs relocating) pairs,
+        and returns its offset."""
+        offset: int = self.start + len(self.contents)
+        for i, (word, relocated) in enumerate(words):
+            if relocated:
+                self.relocations.append(offset + 8 * i)
+            self.contents += word.to_bytes(8, "little")
+        return offset
+
+    def value(self, datum: Datum) -> tuple[int, bool]:
+        """Adds datum and returns its value, and whether that needs
+        relocating."""
+        if isinstance(datum, bytes):
+            return self.constant(serialize_string(datum)) | 0b011, True
+        if isinstance(datum, Vector):
+            header: int = (len(datum.elements) << 4) | 0b1110
+            elements: list[tuple[int, bool]] = [self.value(x) for x in datum.elements]
+            return self.add_object([(header, False)] + elements) | 0b010, True
+        if isinstance(datum, Pair):
+            # Along the cdrs iteratively, so that long lists don't recurse deeply
+            cars: list[Datum] = []
+            rest: Datum = datum
+            while isinstance(rest, Pair):
+                cars.append(rest.car)
+                rest = rest.cdr
+            result: tuple[int, bool] = self.value(rest)
+            for car in reversed(cars):
+                pair: list[tuple[int, bool]] = [self.value(car), result]
+                result = self.add_object(pair) | 0b001, True
+            return result
+        return int.from_bytes(serialize_immediate(datum), "little"), False
+
+
+# Written by the interpreter's build: each handler's name and address
+OPCODES_PATH: str = os.path.join(
+    os.path.dirname(__file__), "..", "interpreter", "opcodes.txt"
+)
+
+
+def read_opcodes(path: str) -> dict[str, int]:
+    result: dict[str, int] = {}
+    with open(path) as f:
+        for line in f:
+            name, address = line.split()
+            result[name] = int(address, 16)
+    return result
 
 
 def main() -> None:
-    for line in filter(lambda l: l.strip(), sys.stdin.readlines()):
-        opcode: int | None = None
-        immediate: bytes = DEFAULT_IMMEDIATE
-        match line.split():
-            case ["LOAD", v]:
-                opcode = 0x10AD000
-                immediate = serialize_immediate(parse_immediate(v))
-            case ["JUMP", v]:
-                opcode = 0x70AD000
-                immediate = int(v).to_bytes(8, "little")
-            case ["CJUMP", v]:
-                opcode = 0xCA7000
-                immediate = int(v).to_bytes(8, "little")
-            case ["GET", v]:
-                opcode = 0x9E7000
-                immediate = int(v).to_bytes(8, "little")
-            case ["FORGET"]:
-                opcode = 0x49E7000
-            case ["ADD1"]:
-                opcode = 0xADD1000
-            case ["SUB1"]:
-                opcode = 0x50B1000
-            case ["ADD", v]:
-                opcode = 0x0ADD000
-                immediate = int(v).to_bytes(8, "little")
-            case ["SUB", v]:
-                opcode = 0x050B000
-                immediate = int(v).to_bytes(8, "little")
-            case ["MUL", v]:
-                opcode = 0x0A55000
-                immediate = int(v).to_bytes(8, "little")
-            case ["LT", v]:
-                opcode = 0x1700000
-                immediate = int(v).to_bytes(8, "little")
-            case ["EQ", v]:
-                opcode = 0xE3E3000
-                immediate = int(v).to_bytes(8, "little")
-            case ["EQP", v]:
-                opcode = 0x3E3E000
-                immediate = int(v).to_bytes(8, "little")
-            case ["ZEROP"]:
-                opcode = 0xEEEE000
-            case ["STRING", v]:
-                opcode = 0x571F000
-                immediate = int(v).to_bytes(8, "little")
-            case ["STRINGREF"]:
-                opcode = 0x571E000
-            case ["STRINGSET"]:
-                opcode = 0x5715000
-            case ["STRINGAPPEND", v]:
-                opcode = 0x571A000
-                immediate = int(v).to_bytes(8, "little")
-            case ["VECTOR", v]:
-                opcode = 0x5ECF000
-                immediate = int(v).to_bytes(8, "little")
-            case ["VECTORREF"]:
-                opcode = 0x5ECE000
-            case ["VECTORSET"]:
-                opcode = 0x5EC5000
-            case ["VECTORAPPEND", v]:
-                opcode = 0x5ECA000
-                immediate = int(v).to_bytes(8, "little")
-            case ["INTEGERP"]:
-                opcode = 0x1234000
-            case ["BOOLEANP"]:
-                opcode = 0xB001000
-            case ["CHARP"]:
-                opcode = 0xCACA000
-            case ["NULLP"]:
-                opcode = 0x4321000
-            case ["NOT"]:
-                opcode = 0x7777000
-            case ["INTTOCHAR"]:
-                opcode = 0x170C000
-            case ["CHARTOINT"]:
-                opcode = 0xC701000
-            case ["FALL", v]:
-                opcode = 0xFA11000
-                immediate = int(v).to_bytes(8, "little")
-            case ["CONS"]:
-                opcode = 0xC0C0000
-            case ["CAR"]:
-                opcode = 0xCA00000
-            case ["CDR"]:
-                opcode = 0xCD00000
-            case _:
-                raise ValueError(f"Couldn't parse line {line}")
-        os.write(1, opcode.to_bytes(8, "little") + immediate)
-    os.write(1, 0xD0D0000.to_bytes(8, "little") + DEFAULT_IMMEDIATE)
+    parser = argparse.ArgumentParser(
+        description="Assembles stdin into bytecode on stdout."
+    )
+    parser.add_argument(
+        "opcodes",
+        nargs="?",
+        default=OPCODES_PATH,
+        help="another interpreter build's opcodes.txt",
+    )
+    parser.add_argument(
+        "--no-fuse",
+        action="store_true",
+        help="leave out the peephole pass that makes superinstructions",
+    )
+    args = parser.parse_args()
+    opcodes: dict[str, int] = read_opcodes(args.opcodes)
+    # Line by line, so that only the parsed instructions are kept in memory
+    instructions: list[Instruction] = [
+        parse_instruction(line, opcodes) for line in sys.stdin if line.strip()
+    ]
+    instructions.append(Instruction(opcodes["done"]))
+    if not args.no_fuse:
+        instructions = fuse(
+            instructions, opcodes, read_generated(GENERATED_PATH, opcodes)
+        )
+
+    # Instructions vary in size, so jump offsets have to be converted from
+    # instruction counts to bytes.
+    starts: list[int] = [0]
+    for instruction in instructions:
+        starts.append(starts[-1] + instruction.size())
+
+    # The data section follows the code, then the relocations, then how many
+    # relocations there are and how big the data section is, so that the
+    # launcher can find where the code ends.
+    data: DataSection = DataSection(starts[-1])
+    # Appended to in place, and written all at once
+    output: bytearray = bytearray()
+    for i, instruction in enumerate(instructions):
+        output += instruction.opcode.to_bytes(8, "little")
+        if instruction.immediate is not None:
+            output += instruction.immediate
+        if instruction.jump is not None:
+            target: int = i + 1 + instruction.jump
+            if target < 0 or target >= len(instructions):
+                raise ValueError(f"Jump target {target} out of range")
+            offset: int = starts[target] - starts[i + 1]
+            output += offset.to_bytes(8, "little", signed=True)
+        if instruction.data is not None:
+            data_offset: int = data.constant(instruction.data) - starts[i + 1]
+            output += data_offset.to_bytes(8, "little")
+        if instruction.datum is not None:
+            pointer, _ = data.value(instruction.datum)
+            data.relocations.append(len(output))
+            output += pointer.to_bytes(8, "little")
+    output += data.contents
+    for relocation in data.relocations:
+        output += relocation.to_bytes(8, "little")
+    output += len(data.relocations).to_bytes(8, "little")
+    output += len(data.contents).to_bytes(8, "little")
+    sys.stdout.buffer.write(output)
+    sys.stdout.buffer.flush()
 
 
 if __name__ == "__main__":
@@ -0,0 +1,325 @@
+import argparse
+import os
+import re
+import sys
+from collections import Counter
+from dataclasses import dataclass
+
+from main import (
+    GENERATED_PATH,
+    OPCODES_PATH,
+    Generated,
+    Instruction,
+    fuse_with_origins,
+    read_opcodes,
+)
+
+# usage: superinstructions.py [-k K] [--max-length N] bytecode profile ...
+# Picks the K superinstructions that would save the most dispatches in the
+# profiled workloads, and generates them. To profile a workload, build the
+# interpreter with make PROFILE=1, assemble the workload for it with --no-fuse,
+# and run it as interpreter bytecode profile. Then rebuild the interpreter
+# normally to pick up the generated files.
+
+INTERPRETER_PATH: str = os.path.join(os.path.dirname(__file__), "..", "interpreter")
+
+# The handlers whose (last) immediate is a jump offset
+JUMP_HANDLERS: set[str] = {
+    "jump",
+    "cjump",
+    "branchiffalse",
+    "branchifnotlt",
+    "branchifnoteq",
+    "branchifnotzero",
+    "branchifnotnull",
+}
+
+# The handlers whose last immediate is an offset into the data section
+DATA_HANDLERS: set[str] = {"stringlit"}
+
+# Local label that each handler in a generated superinstruction dispatches to
+# the next one with, instead of NEXT. handlers.inc doesn't use it.
+JOIN_LABEL: str = "88"
+
+
+@dataclass
+class Workload:
+    instructions: list[Instruction]
+    names: list[str]
+    # How many times each instruction ran
+    counts: list[int]
+    # The instructions that something jumps to
+    targets: set[int]
+
+
+def read_handlers() -> tuple[dict[str, int], set[str]]:
+    """Returns how many immediates each handler takes, and which handlers are
+    superinstructions."""
+    immediate_counts: dict[str, int] = {}
+    superinstructions: set[str] = set()
+    pattern: str = r"X\((\w+), (\d+)\)"
+    with open(os.path.join(INTERPRETER_PATH, "opcodes.h")) as f:
+        base, fused = f.read().split("#define FUSED_OPCODES(X)")
+    with open(os.path.join(INTERPRETER_PATH, "superinstructions.h")) as f:
+        generated = f.read()
+    for name, count in re.findall(pattern, base):
+        immediate_counts[name] = int(count)
+    for name, count in re.findall(pattern, fused + generated):
+        immediate_counts[name] = int(count)
+        superinstructions.add(name)
+    return immediate_counts, superinstructions
+
+
+def read_words(path: str) -> list[int]:
+    with open(path, "rb") as f:
+        data: bytes = f.read()
+    return [
+        int.from_bytes(data[i : i + 8], "little") for i in range(0, len(data), 8)
+    ]
+
+
+def read_workload(
+    bytecode_path: str,
+    profile_path: str,
+    opcodes: dict[str, int],
+    immediate_counts: dict[str, int],
+    superinstructions: set[str],
+) -> Workload:
+    names_by_opcode: dict[int, str] = {
+        opcode: name for name, opcode in opcodes.items()
+    }
+    words: list[int] = read_words(bytecode_path)
+    word_counts: list[int] = read_words(profile_path)
+    if len(word_counts) != len(words):
+        raise ValueError(f"{profile_path} isn't a profile of {bytecode_path}")
+    # Leave out the data section, the relocations, and the two words that say
+    # how big they are
+    relocation_count: int = words[-2]
+    relocated: set[int] = {
+        offset // 8 for offset in words[len(words) - 2 - relocation_count : -2]
+    }
+    words = words[: len(words) - 2 - relocation_count - words[-1] // 8]
+
+    starts: list[int] = []
+    w: int = 0
+    while w < len(words):
+        starts.append(w)
+        name: str = names_by_opcode[words[w]]
+        if name in superinstructions:
+            raise ValueError(f"{bytecode_path} wasn't assembled with --no-fuse")
+        w += 1 + immediate_counts[name]
+    index_at: dict[int, int] = {start: i for i, start in enumerate(starts)}
+    starts.append(w)
+
+    workload: Workload = Workload([], [], [], set())
+    for i, start in enumerate(starts[:-1]):
+        name = names_by_opcode[words[start]]
+        immediates: list[int] = words[start + 1 : starts[i + 1]]
+        jump: int | None = None
+        # Its contents don't matter, only that the instruction has a constant
+        data: bytes | None = None
+        if name in DATA_HANDLERS:
+            immediates.pop()
+            data = b""
+        elif not relocated.isdisjoint(range(start + 1, starts[i + 1])):
+            data = b""  # a pointer to quoted data
+        if name in JUMP_HANDLERS:
+            offset: int = immediates.pop()
+            if offset >= 2**63:
+                offset -= 2**64
+            target: int = index_at[starts[i + 1] + offset // 8]
+            workload.targets.add(target)
+            jump = target - (i + 1)
+        immediate: bytes | None = (
+            b"".join(x.to_bytes(8, "little") for x in immediates) or None
+        )
+        workload.instructions.append(
+            Instruction(words[start], immediate, jump, data)
+        )
+        workload.names.append(name)
+        workload.counts.append(word_counts[start])
+    return workload
+
+
+def ordered(chosen: list[Generated]) -> list[Generated]:
+    """The order that the peephole pass should try them in: longest first, so
+    that a sequence doesn't lose out to its own prefix."""
+    return sorted(chosen, key=lambda g: -len(g[1]))
+
+
+def fuse_workload(
+    workload: Workload, opcodes: dict[str, int], chosen: list[Generated]
+) -> tuple[int, set[int]]:
+    """Returns how many dispatches the workload would take with chosen, and
+    which of its instructions would be in a superinstruction."""
+    # They don't have handlers yet, so make up opcodes that can't clash
+    with_chosen: dict[str, int] = opcodes | {
+        name: -1 - i for i, (name, _) in enumerate(chosen)
+    }
+    _, origins = fuse_with_origins(
+        workload.instructions, with_chosen, ordered(chosen)
+    )
+    origins.append(len(workload.instructions))
+    dispatches: int = 0
+    fused: set[int] = set()
+    for start, end in zip(origins, origins[1:]):
+        dispatches += workload.counts[start]
+        if end - start > 1:
+            fused.update(range(start, end))
+    return dispatches, fused
+
+
+def count_sequences(
+    workload: Workload, fused: set[int], max_length: int, scores: Counter
+) -> None:
+    """Adds how many dispatches fusing each sequence would save to scores,
+    leaving out instructions that are already fused."""
+    n: int = len(workload.instructions)
+    for i in range(n):
+        for length in range(2, max_length + 1):
+            last: int = i + length - 1
+            if last >= n or last in fused or last in workload.targets:
+                break
+            if i in fused or workload.names[last - 1] in JUMP_HANDLERS:
+                break
+            if workload.names[last] == "done":
+                break
+            if any(x.has_constant() for x in workload.instructions[i : last + 1]):
+                break
+            sequence: tuple[str, ...] = tuple(workload.names[i : last + 1])
+            scores[sequence] += workload.counts[i] * (length - 1)
+
+
+def read_handler_bodies() -> dict[str, list[str]]:
+    bodies: dict[str, list[str]] = {}
+    current: list[str] | None = None
+    with open(os.path.join(INTERPRETER_PATH, "handlers.inc")) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            match = re.fullmatch(r"HANDLER\((\w+)\)", line)
+            if match:
+                current = bodies.setdefault(match.group(1), [])
+            elif line.startswith("//") or line.startswith("#"):
+                current = None
+            elif current is not None:
+                current.append(line)
+    for body in bodies.values():
+        while body and not body[-1].strip():
+            body.pop()
+    return bodies
+
+
+def fused_body(sequence: list[str], bodies: dict[str, list[str]]) -> list[str]:
+    """The handlers' bodies one after the other, each dispatching to the next
+    by jumping to it instead of with NEXT."""
+    result: list[str] = []
+    for i, handler in enumerate(sequence):
+        body: list[str] = bodies[handler]
+        if i > 0:
+            result.append(f"{JOIN_LABEL}:")
+        if i < len(sequence) - 1:
+            join: str = f"    jmp {JOIN_LABEL}f"
+            body = [join if line.strip() == "NEXT" else line for line in body]
+            if body[-1] == join:
+                body = body[:-1]  # falls through instead
+        result += body
+    return result
+
+
+def x_macro(name: str, entries: list[str]) -> str:
+    lines: list[str] = [f"#define {name}(X)"] + [f"    {entry}" for entry in entries]
+    return " \\\n".join(line.ljust(78) for line in lines[:-1]) + (
+        " \\\n" + lines[-1] if len(lines) > 1 else lines[0]
+    )
+
+
+def write_generated(chosen: list[Generated], immediate_counts: dict[str, int]) -> None:
+    bodies: dict[str, list[str]] = read_handler_bodies()
+    header: str = "Generated by assembler/superinstructions.py"
+
+    with open(GENERATED_PATH, "w") as f:
+        f.write(f"# {header}.\n")
+        f.write("# Each superinstruction's handler, then the handlers it fuses, in\n")
+        f.write("# the order that the assembler tries them.\n")
+        for name, sequence in chosen:
+            f.write(f"{name} {' '.join(sequence)}\n")
+
+    opcodes: list[str] = [
+        f"X({name}, {sum(immediate_counts[h] for h in sequence)})"
+        for name, sequence in chosen
+    ]
+    sequences: list[str] = [
+        f"X({name}, {', '.join('OPCODE_' + h for h in sequence)})"
+        for name, sequence in chosen
+    ]
+    with open(os.path.join(INTERPRETER_PATH, "superinstructions.h"), "w") as f:
+        f.write("#pragma once\n\n")
+        f.write(f"// {header}.\n\n")
+        f.write("// X(name, number of immediates), as in opcodes.h\n")
+        f.write(x_macro("GENERATED_OPCODES", opcodes) + "\n\n")
+        f.write("// X(name, the opcode of each handler it fuses...)\n")
+        f.write(x_macro("GENERATED_SEQUENCES", sequences) + "\n")
+
+    with open(os.path.join(INTERPRETER_PATH, "superinstructions.inc"), "w") as f:
+        f.write(f"// {header}, from the bodies of\n")
+        f.write("// the handlers that each one fuses.\n")
+        for name, sequence in chosen:
+            f.write(f"\n// {' ; '.join(sequence)}\n")
+            f.write(f"HANDLER({name})\n")
+            f.write("\n".join(fused_body(sequence, bodies)) + "\n")
+
+    for suffix in ["", "_unchecked"]:
+        path: str = os.path.join(INTERPRETER_PATH, f"superinstructions{suffix}.ld")
+        with open(path, "w") as f:
+            f.write(f"/* {header}. */\n")
+            for name, _ in chosen:
+                f.write(f"*(.text.{name}{suffix})\n")
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Generates superinstructions from profiles."
+    )
+    parser.add_argument(
+        "files", nargs="*", help="bytecode file, profile, bytecode file, ..."
+    )
+    parser.add_argument("-k", type=int, default=8, help="how many to generate")
+    parser.add_argument(
+        "--max-length", type=int, default=4, help="most instructions to fuse"
+    )
+    parser.add_argument(
+        "--opcodes", default=OPCODES_PATH, help="the profiling build's opcodes.txt"
+    )
+    args = parser.parse_args()
+    if len(args.files) % 2 != 0:
+        parser.error("expected a profile for every bytecode file")
+
+    opcodes: dict[str, int] = read_opcodes(args.opcodes)
+    immediate_counts, superinstructions = read_handlers()
+    workloads: list[Workload] = [
+        read_workload(bytecode, profile, opcodes, immediate_counts, superinstructions)
+        for bytecode, profile in zip(args.files[::2], args.files[1::2])
+    ]
+
+    # Greedily, since what's worth fusing depends on what's already fused
+    chosen: list[Generated] = []
+    baseline: int = sum(fuse_workload(w, opcodes, [])[0] for w in workloads)
+    while len(chosen) < args.k:
+        scores: Counter = Counter()
+        for workload in workloads:
+            _, fused = fuse_workload(workload, opcodes, chosen)
+            count_sequences(workload, fused, args.max_length, scores)
+        if not scores:
+            break
+        sequence, saved = scores.most_common(1)[0]
+        chosen.append(("fused_" + "_".join(sequence), list(sequence)))
+        print(f"{' ; '.join(sequence)}: saves {saved} dispatches", file=sys.stderr)
+    chosen = ordered(chosen)
+
+    final: int = sum(fuse_workload(w, opcodes, chosen)[0] for w in workloads)
+    print(f"{baseline} dispatches before, {final} after", file=sys.stderr)
+    write_generated(chosen, immediate_counts)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+
+set -euo pipefail
+
+# usage: ./bench-dispatch.bash
+# Builds a direct-threaded interpreter (make DISPATCH=jmp) in a scratch copy
+# of interpreter/, then benchmarks it against the usual ret-threaded one.
+
+jmp_build="$(mktemp -d)"
+trap 'rm -rf "$jmp_build"' EXIT
+
+cp -r ./interpreter/. "$jmp_build"
+make -C "$jmp_build" clean > /dev/null
+make -C "$jmp_build" DISPATCH=jmp > /dev/null
+
+./bench.bash ./interpreter/interpreter "$jmp_build/interpreter"
@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+
+set -euo pipefail
+
+# usage: ./bench.bash [interpreter...]
+# Each benchmark is a bytecode loop in bench/*/in, and bench/*/dispatches is
+# how many instructions it executes. Pass several interpreters to compare them.
+# bench/large is a loop with a body too big for the smaller caches.
+# Benchmarks with a values file instead of dispatches time printing: they're
+# reported per value printed.
+# Opcodes are handler addresses, so each interpreter gets the benchmark
+# assembled against the opcodes.txt next to it. Benchmarks are assembled
+# without superinstructions, so that they time the handlers they're named for.
+# If perf is installed, branch mispredictions are counted too.
+
+RUNS=5
+
+./build.bash
+
+interpreters=("$@")
+if [ "${#interpreters[@]}" -eq 0 ]; then
+    interpreters=(./interpreter/interpreter)
+fi
+
+bytecode="$(mktemp)"
+trap 'rm -f "$bytecode"' EXIT
+
+for b in bench/*; do
+    if [ -f "$b/values" ]; then
+        unit=value
+        count="$(cat "$b/values")"
+    else
+        unit=dispatch
+        count="$(cat "$b/dispatches")"
+    fi
+    for interpreter in "${interpreters[@]}"; do
+        uv run ./assembler/main.py --no-fuse \
+            "$(dirname "$interpreter")/opcodes.txt" \
+            < "$b/in" > "$bytecode"
+        if [ "$interpreter" = "${interpreters[0]}" ]; then
+            printf '%s: %s bytes of bytecode\n' "$b" "$(wc -c < "$bytecode")"
+        fi
+        best=''
+        for _ in $(seq "$RUNS"); do
+            start="$(date +%s%N)"
+            "$interpreter" "$bytecode" > /dev/null
+            end="$(date +%s%N)"
+            elapsed=$((end - start))
+            if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+                best="$elapsed"
+            fi
+        done
+        printf '%s (%s): %s ns/%s\n' "$b" "$interpreter" \
+            "$(awk "BEGIN { printf \"%.3f\", $best / $count }")" "$unit"
+        if command -v perf > /dev/null; then
+            misses="$(perf stat -x, -e branch-misses "$interpreter" "$bytecode" \
+                2>&1 > /dev/null | cut -d, -f1)"
+            # Not a number if the counter isn't supported (e.g. in a VM)
+            if [[ "$misses" =~ ^[0-9]+$ ]]; then
+                printf '%s (%s): %s branch misses/%s\n' "$b" "$interpreter" \
+                    "$(awk "BEGIN { printf \"%.3f\", $misses / $count }")" \
+                    "$unit"
+            fi
+        fi
+    done
+done
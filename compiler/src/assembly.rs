@@ -0,0 +1,129 @@
+// The compiler's output. Each instruction prints as a line of the assembly
+// language that assembler/main.py reads, and bytecode.rs lays them out as
+// bytecode directly.
+
+use std::fmt;
+
+// A value that an instruction can carry as an immediate
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Value {
+    Int(u64),
+    Bool(bool),
+    Char(u8),
+    Null,
+    Unspecified,
+}
+
+// What LOAD can load from the data section
+#[derive(Debug, PartialEq)]
+pub enum Datum {
+    Value(Value),
+    String(Vec<u8>),
+    // The cars of a list, and its last cdr. Flat so that long lists don't
+    // recurse deeply.
+    List(Vec<Datum>, Box<Datum>),
+    Vector(Vec<Datum>),
+}
+
+#[derive(Debug, PartialEq)]
+pub enum Operand {
+    None,
+    // An arity, or how deep a stack slot is
+    Count(usize),
+    Value(Value),
+    // How many instructions to skip. (-1 jumps to itself.)
+    Jump(i64),
+    String(Vec<u8>),
+    Datum(Datum),
+}
+
+#[derive(Debug, PartialEq)]
+pub struct Instruction {
+    pub mnemonic: &'static str,
+    pub operand: Operand,
+}
+
+impl Instruction {
+    pub fn new(mnemonic: &'static str, operand: Operand) -> Instruction {
+        Instruction { mnemonic, operand }
+    }
+}
+
+impl fmt::Display for Value {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Value::Int(x) => write!(f, "{x}"),
+            Value::Bool(x) => f.write_str(if *x { "#t" } else { "#f" }),
+            Value::Char(x) => write!(f, "#\\x{x:02x}"),
+            Value::Null => f.write_str("NULL"),
+            Value::Unspecified => f.write_str("UNSPECIFIED"),
+        }
+    }
+}
+
+// In Scheme's syntax, which is the assembler's
+impl fmt::Display for Datum {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Datum::Value(Value::Null) => f.write_str("()"),
+            Datum::Value(x) => write!(f, "{x}"),
+            Datum::String(v) => write_string(f, v),
+            Datum::List(cars, tail) => {
+                f.write_str("(")?;
+                for (i, car) in cars.iter().enumerate() {
+                    write!(f, "{}{car}", if i == 0 { "" } else { " " })?;
+                }
+                if **tail != Datum::Value(Value::Null) {
+                    write!(f, " . {tail}")?;
+                }
+                f.write_str(")")
+            }
+            Datum::Vector(elements) => {
+                f.write_str("#(")?;
+                for (i, element) in elements.iter().enumerate() {
+                    write!(f, "{}{element}", if i == 0 { "" } else { " " })?;
+                }
+                f.write_str(")")
+            }
+        }
+    }
+}
+
+impl fmt::Display for Instruction {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str(self.mnemonic)?;
+        match &self.operand {
+            Operand::None => Ok(()),
+            Operand::Count(n) => write!(f, " {n}"),
+            Operand::Value(x) => write!(f, " {x}"),
+            Operand::Jump(n) => write!(f, " {n}"),
+            Operand::String(v) => {
+                f.write_str(" ")?;
+                write_string(f, v)
+            }
+            Operand::Datum(datum) => write!(f, " {datum}"),
+        }
+    }
+}
+
+// A string constant: printable ASCII as is, except for the escaped " and \, and
+// everything else as \xNN.
+fn write_string(f: &mut fmt::Formatter, v: &[u8]) -> fmt::Result {
+    f.write_str("\"")?;
+    for &c in v {
+        match c {
+            b'"' | b'\\' => write!(f, "\\{}", c as char)?,
+            b' '..=b'~' => write!(f, "{}", c as char)?,
+            _ => write!(f, "\\x{c:02x}")?,
+        }
+    }
+    f.write_str("\"")
+}
+
+// So that tests can compare instructions with the lines they print as
+#[cfg(test)]
+impl PartialEq<&str> for Instruction {
+    fn eq(&self, other: &&str) -> bool {
+        self.to_string() == *other
+    }
+}
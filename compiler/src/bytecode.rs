@@ -0,0 +1,422 @@
+// The bytecode backend. It lays out the compiler's instructions the way
+// assembler/main.py lays out their assembly, peephole pass included, so that
+// running a program doesn't have to start Python. The text assembler stays the
+// reference, and the way to look at what the compiler emits.
+
+use crate::assembly::{self, Datum, Operand, Value};
+use std::{
+    collections::{HashMap, HashSet},
+    ops::Range,
+};
+
+// Each handler's address, from the interpreter build's opcodes.txt
+pub type Opcodes = HashMap<String, u64>;
+
+pub fn read_opcodes(text: &str) -> Opcodes {
+    text.lines()
+        .filter_map(|line| line.split_once(' '))
+        .map(|(name, address)| {
+            let address = address.trim().trim_start_matches("0x");
+            let address = u64::from_str_radix(address, 16).expect("Invalid opcodes.txt");
+            (name.to_owned(), address)
+        })
+        .collect()
+}
+
+// A generated superinstruction: its handler, and the handlers it fuses
+type Generated = (String, Vec<String>);
+
+// Leaves out superinstructions that the interpreter wasn't built with.
+pub fn read_generated(text: &str, opcodes: &Opcodes) -> Vec<Generated> {
+    text.lines()
+        .filter(|line| !line.starts_with('#'))
+        .filter_map(|line| {
+            let mut words = line.split_whitespace().map(str::to_owned);
+            let name = words.next()?;
+            opcodes.contains_key(&name).then(|| (name, words.collect()))
+        })
+        .collect()
+}
+
+const TAGGED_FALSE: u64 = 0b00011111;
+const TAGGED_TRUE: u64 = 0b10011111;
+const TAGGED_NULL: u64 = 0b00101111;
+const UNSPECIFIED: u64 = u64::MAX;
+
+// An instruction as it's laid out
+#[derive(Debug)]
+struct Instruction<'a> {
+    handler: String,
+    // Words that follow the opcode
+    immediates: Vec<u64>,
+    // For jumps, how many instructions to skip. (-1 jumps to itself.) The
+    // offset goes after any immediates.
+    jump: Option<i64>,
+    // A string for the data section. The instruction's last word is the offset
+    // to it, relative to the next instruction like a jump's.
+    data: Option<Vec<u8>>,
+    // A list or vector for the data section. The instruction's last word is a
+    // pointer to it, which the launcher relocates.
+    datum: Option<&'a Datum>,
+}
+
+impl Instruction<'_> {
+    fn new(handler: &str) -> Self {
+        Instruction {
+            handler: handler.to_owned(),
+            immediates: Vec::new(),
+            jump: None,
+            data: None,
+            datum: None,
+        }
+    }
+
+    fn size(&self) -> usize {
+        8 * (1 + self.immediates.len() + usize::from(self.jump.is_some()))
+            + if self.has_constant() { 8 } else { 0 }
+    }
+
+    fn has_constant(&self) -> bool {
+        self.data.is_some() || self.datum.is_some()
+    }
+}
+
+fn tagged(v: Value) -> u64 {
+    match v {
+        Value::Int(x) => {
+            assert!(x < 1 << 62, "Integer {x} out of range");
+            x << 2
+        }
+        Value::Bool(x) => {
+            if x {
+                TAGGED_TRUE
+            } else {
+                TAGGED_FALSE
+            }
+        }
+        Value::Char(x) => (u64::from(x) << 8) | 0b00001111,
+        Value::Null => TAGGED_NULL,
+        Value::Unspecified => UNSPECIFIED,
+    }
+}
+
+fn encode(instruction: &assembly::Instruction) -> Instruction<'_> {
+    // Handlers are named after their mnemonics
+    let mut result = Instruction::new(&instruction.mnemonic.replace('_', "").to_lowercase());
+    match &instruction.operand {
+        Operand::None => {}
+        Operand::Count(n) => result.immediates.push(*n as u64),
+        Operand::Value(v) => result.immediates.push(tagged(*v)),
+        Operand::Jump(n) => result.jump = Some(*n),
+        Operand::String(v) => result.data = Some(serialize_string(v)),
+        Operand::Datum(datum) => result.datum = Some(datum),
+    }
+    result
+}
+
+fn serialize_string(v: &[u8]) -> Vec<u8> {
+    let header = ((v.len() as u64) << 4) | 0b0110;
+    let mut result = header.to_le_bytes().to_vec();
+    result.extend_from_slice(v);
+    result.resize(8 + v.len().next_multiple_of(8), 0);
+    result
+}
+
+// Whether the instruction adds the top two values, in either form.
+fn is_add2(instruction: &Instruction) -> bool {
+    instruction.handler == "add2" || (instruction.handler == "add" && instruction.immediates == [2])
+}
+
+// Wide enough for the longest hand-written sequence below
+const SUPERINSTRUCTION_MAX_LENGTH: usize = 3;
+
+// If window starts with a sequence that has a superinstruction, returns how
+// many instructions it replaces, its handler, and its immediates.
+fn superinstruction(
+    window: &[Instruction],
+    generated: &[Generated],
+) -> Option<(usize, String, Vec<u64>)> {
+    let handlers: Vec<&str> = window.iter().map(|x| x.handler.as_str()).collect();
+    let immediates = |range: Range<usize>| -> Vec<u64> {
+        window[range]
+            .iter()
+            .flat_map(|x| x.immediates.iter().copied())
+            .collect()
+    };
+    let (length, name, immediates) = match handlers[..] {
+        ["get", "get", _, ..] if is_add2(&window[2]) => (3, "getgetadd", immediates(0..2)),
+        // Not a superinstruction, just the instruction the compiler would emit
+        // for (+ x k)
+        ["load", _, ..]
+            if is_add2(&window[1]) && matches!(window[0].immediates[..], [k] if k & 0b11 == 0) =>
+        {
+            (2, "addi", immediates(0..1))
+        }
+        ["get", "car", ..] => (2, "getcar", immediates(0..1)),
+        ["load", "cons", ..] if window[0].immediates == [TAGGED_NULL] => {
+            (2, "loadnullcons", Vec::new())
+        }
+        ["forget", "load", ..] => (2, "forgetload", immediates(1..2)),
+        ["forget", "get", ..] => (2, "forgetget", immediates(1..2)),
+        _ => {
+            return generated.iter().find_map(|(name, sequence)| {
+                (handlers.len() >= sequence.len()
+                    && handlers.iter().zip(sequence).all(|(a, b)| a == b))
+                .then(|| (sequence.len(), name.clone(), immediates(0..sequence.len())))
+            });
+        }
+    };
+    Some((length, name.to_owned(), immediates))
+}
+
+// The peephole pass. Replaces sequences with their superinstructions, unless
+// something jumps into the middle of them, and fixes up the jumps.
+fn fuse<'a>(
+    mut instructions: Vec<Instruction<'a>>,
+    generated: &[Generated],
+) -> Vec<Instruction<'a>> {
+    let mut targets = HashSet::new();
+    for (i, instruction) in instructions.iter().enumerate() {
+        if let Some(jump) = instruction.jump {
+            targets.insert(jump_target(i, jump, instructions.len()));
+        }
+    }
+    let window_length = generated
+        .iter()
+        .map(|(_, sequence)| sequence.len())
+        .fold(SUPERINSTRUCTION_MAX_LENGTH, usize::max);
+
+    let mut result: Vec<Instruction> = Vec::new();
+    // For each of the original instructions, where it ended up in result
+    let mut new_index = Vec::new();
+    // Jumps in result, and their targets in instructions
+    let mut jumps = Vec::new();
+    let mut i = 0;
+    while i < instructions.len() {
+        let window = &instructions[i..(i + window_length).min(instructions.len())];
+        let mut length = 1;
+        let mut current = None;
+        // Only the last instruction of a sequence can jump, and nothing can
+        // jump into the middle of one. Superinstructions don't have constants.
+        if let Some((fused_length, name, immediates)) = superinstruction(window, generated)
+            && (i + 1..i + fused_length).all(|j| !targets.contains(&j))
+            && window[..fused_length - 1].iter().all(|x| x.jump.is_none())
+            && !window[..fused_length].iter().any(Instruction::has_constant)
+        {
+            length = fused_length;
+            let mut fused = Instruction::new(&name);
+            fused.immediates = immediates;
+            fused.jump = window[length - 1].jump;
+            current = Some(fused);
+        }
+        let current = current
+            .unwrap_or_else(|| std::mem::replace(&mut instructions[i], Instruction::new("done")));
+        if let Some(jump) = current.jump {
+            jumps.push((
+                result.len(),
+                jump_target(i + length - 1, jump, instructions.len()),
+            ));
+        }
+        new_index.resize(new_index.len() + length, result.len());
+        result.push(current);
+        i += length;
+    }
+
+    for (j, target) in jumps {
+        result[j].jump = Some(new_index[target] as i64 - (j as i64 + 1));
+    }
+    result
+}
+
+fn jump_target(i: usize, jump: i64, len: usize) -> usize {
+    let target = i as i64 + 1 + jump;
+    assert!(
+        (0..len as i64).contains(&target),
+        "Jump target {target} out of range"
+    );
+    target as usize
+}
+
+// The constants that follow the code. Each is laid out like the heap object it
+// stands for, with pointers as offsets from the start of the bytecode. The
+// launcher adds the bytecode's address to each word in relocations.
+struct DataSection {
+    // Where the data section starts in the bytecode
+    start: u64,
+    contents: Vec<u8>,
+    // Offsets of words in the bytecode
+    relocations: Vec<u64>,
+    // Constants without pointers in them only need to be added once
+    offsets: HashMap<Vec<u8>, u64>,
+}
+
+impl DataSection {
+    // Returns the offset of a constant that has no pointers in it.
+    fn constant(&mut self, serialized: &[u8]) -> u64 {
+        if let Some(&offset) = self.offsets.get(serialized) {
+            return offset;
+        }
+        let offset = self.start + self.contents.len() as u64;
+        self.contents.extend_from_slice(serialized);
+        self.offsets.insert(serialized.to_vec(), offset);
+        offset
+    }
+
+    // Adds an object made of (word, whether it needs relocating) pairs, and
+    // returns its offset.
+    fn add_object(&mut self, words: &[(u64, bool)]) -> u64 {
+        let offset = self.start + self.contents.len() as u64;
+        for (i, &(word, relocated)) in words.iter().enumerate() {
+            if relocated {
+                self.relocations.push(offset + 8 * i as u64);
+            }
+            self.contents.extend_from_slice(&word.to_le_bytes());
+        }
+        offset
+    }
+
+    // Adds datum and returns its value, and whether that needs relocating.
+    fn value(&mut self, datum: &Datum) -> (u64, bool) {
+        match datum {
+            Datum::Value(v) => (tagged(*v), false),
+            Datum::String(v) => (self.constant(&serialize_string(v)) | 0b011, true),
+            Datum::Vector(elements) => {
+                let header = ((elements.len() as u64) << 4) | 0b1110;
+                let mut words = vec![(header, false)];
+                words.extend(elements.iter().map(|x| self.value(x)));
+                (self.add_object(&words) | 0b010, true)
+            }
+            Datum::List(cars, tail) => {
+                let mut result = self.value(tail);
+                for car in cars.iter().rev() {
+                    let pair = [self.value(car), result];
+                    result = (self.add_object(&pair) | 0b001, true);
+                }
+                result
+            }
+        }
+    }
+}
+
+fn word(output: &mut Vec<u8>, v: u64) {
+    output.extend_from_slice(&v.to_le_bytes());
+}
+
+pub fn assemble(
+    program: &[assembly::Instruction],
+    opcodes: &Opcodes,
+    generated: &[Generated],
+) -> Vec<u8> {
+    let mut instructions: Vec<Instruction> = program.iter().map(encode).collect();
+    instructions.push(Instruction::new("done"));
+    let instructions = fuse(instructions, generated);
+
+    // Instructions vary in size, so jump offsets have to be converted from
+    // instruction counts to bytes.
+    let mut starts = vec![0];
+    for instruction in &instructions {
+        starts.push(starts.last().unwrap() + instruction.size() as u64);
+    }
+
+    // The data section follows the code, then the relocations, then how many
+    // relocations there are and how big the data section is, so that the
+    // launcher can find where the code ends.
+    let mut data = DataSection {
+        start: *starts.last().unwrap(),
+        contents: Vec::new(),
+        relocations: Vec::new(),
+        offsets: HashMap::new(),
+    };
+    let mut output: Vec<u8> = Vec::with_capacity(*starts.last().unwrap() as usize);
+    for (i, instruction) in instructions.iter().enumerate() {
+        let opcode = *opcodes
+            .get(&instruction.handler)
+            .unwrap_or_else(|| panic!("No handler named {}", instruction.handler));
+        word(&mut output, opcode);
+        for &immediate in &instruction.immediates {
+            word(&mut output, immediate);
+        }
+        if let Some(jump) = instruction.jump {
+            let target = jump_target(i, jump, instructions.len());
+            word(&mut output, starts[target].wrapping_sub(starts[i + 1]));
+        }
+        if let Some(v) = &instruction.data {
+            word(&mut output, data.constant(v) - starts[i + 1]);
+        }
+        if let Some(datum) = instruction.datum {
+            let (pointer, _) = data.value(datum);
+            data.relocations.push(output.len() as u64);
+            word(&mut output, pointer);
+        }
+    }
+    output.extend_from_slice(&data.contents);
+    for &relocation in &data.relocations {
+        word(&mut output, relocation);
+    }
+    word(&mut output, data.relocations.len() as u64);
+    word(&mut output, data.contents.len() as u64);
+    output
+}
+
+#[cfg(test)]
+fn test_opcodes() -> Opcodes {
+    ["load", "get", "add2", "addi", "jump", "stringlit", "done"]
+        .iter()
+        .enumerate()
+        .map(|(i, name)| (name.to_string(), 0x1000 * (i as u64 + 1)))
+        .collect()
+}
+
+#[cfg(test)]
+fn words(bytecode: &[u8]) -> Vec<u64> {
+    bytecode
+        .chunks(8)
+        .map(|x| u64::from_le_bytes(x.try_into().unwrap()))
+        .collect()
+}
+
+#[test]
+fn jumps_are_in_bytes_after_fusion() {
+    let program = [
+        assembly::Instruction::new("GET", Operand::Count(0)),
+        assembly::Instruction::new("LOAD", Operand::Value(Value::Int(1))),
+        assembly::Instruction::new("ADD2", Operand::None),
+        assembly::Instruction::new("JUMP", Operand::Jump(-4)),
+        assembly::Instruction::new("STRINGLIT", Operand::String(b"a".to_vec())),
+    ];
+    let expected = [
+        // GET 0, then LOAD 1 and ADD2 fused into ADDI 1
+        &[0x2000, 0][..],
+        &[0x4000, 4],
+        // Back to the GET
+        &[0x5000, -48i64 as u64],
+        // "a" is 8 bytes after the STRINGLIT, past the DONE
+        &[0x6000, 8],
+        &[0x7000],
+        &[(1 << 4) | 0b0110, u64::from(b'a')],
+        // No relocations, and 16 bytes of data
+        &[0, 16],
+    ]
+    .concat();
+    assert_eq!(words(&assemble(&program, &test_opcodes(), &[])), expected);
+}
+
+#[test]
+fn quoted_data_is_relocated() {
+    // (1 . #(#\a))
+    let vector = Datum::Vector(vec![Datum::Value(Value::Char(b'a'))]);
+    let list = Datum::List(vec![Datum::Value(Value::Int(1))], Box::new(vector));
+    let program = [assembly::Instruction::new("LOAD", Operand::Datum(list))];
+    let expected = [
+        // The pair is at 40, after the vector that it points to
+        &[0x1000, 40 | 0b001][..],
+        &[0x7000],
+        &[(1 << 4) | 0b1110, (0x61 << 8) | 0b1111],
+        &[1 << 2, 24 | 0b010],
+        // The pair's cdr, then the LOAD's pointer
+        &[48, 8],
+        &[2, 32],
+    ]
+    .concat();
+    assert_eq!(words(&assemble(&program, &test_opcodes(), &[])), expected);
+}
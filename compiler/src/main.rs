@@ -1,6 +1,12 @@
+mod assembly;
+mod bytecode;
+
+use assembly::{Datum, Instruction, Operand, Value};
 use std::{
     collections::HashMap,
-    io::{Read, stdin},
+    env::args,
+    fs::read_to_string,
+    io::{Read, Write, stdin, stdout},
     str::from_utf8,
 };
 
@@ -10,9 +16,12 @@ enum Expression<'a> {
     Bool(bool),
     Char(u8),
     Symbol(&'a [u8]),
-    Null,
+    Quote(Box<Expression<'a>>),
     Form(Vec<Expression<'a>>),
+    Vector(Vec<Expression<'a>>),
     String(Vec<u8>),
+    // The . before a dotted list's tail, which only data can contain, not code
+    Dot,
 }
 
 fn is_delimiter(v: u8) -> bool {
@@ -117,25 +126,32 @@ fn consume_character(input: &[u8]) -> Option<(u8, &[u8])> {
     }
 }
 
-fn consume_null(input: &[u8]) -> Option<&[u8]> {
+// 'datum, or (quote datum), whose datum is parsed the same way. A quote form
+// with any other number of arguments is left to lower_form to reject.
+fn consume_quote(input: &[u8]) -> Option<(Expression<'_>, &[u8])> {
     if let Some(input) = consume_bytes(input, b"'") {
-        if let Some(input) = consume_bytes(consume_whitespace(input), b"(") {
-            if let Some(input) = consume_bytes(consume_whitespace(input), b")") {
-                Some(input)
-            } else {
-                None
-            }
+        if let Some((datum, input)) = consume_datum(consume_whitespace(input)) {
+            Some((Expression::Quote(Box::new(datum)), input))
         } else {
             None
         }
+    } else if let Some(input) = consume_bytes(input, b"(")
+        && let Some((b"quote", input)) = consume_symbol(consume_whitespace(input))
+        && let Some((datum, input)) = consume_datum(consume_whitespace(input))
+        && let Some(input) = consume_bytes(consume_whitespace(input), b")")
+    {
+        Some((Expression::Quote(Box::new(datum)), input))
     } else {
         None
     }
 }
 
-fn consume_form(input: &[u8]) -> Option<(Vec<Expression<'_>>, &[u8])> {
+fn consume_form(
+    input: &[u8],
+    consume_item: fn(&[u8]) -> Option<(Expression<'_>, &[u8])>,
+) -> Option<(Vec<Expression<'_>>, &[u8])> {
     if let Some(input) = consume_bytes(input, b"(") {
-        let (args, input) = consume_expressions(consume_whitespace(input));
+        let (args, input) = consume_items(consume_whitespace(input), consume_item);
         if let Some(input) = consume_bytes(consume_whitespace(input), b")") {
             Some((args, input))
         } else {
@@ -146,6 +162,15 @@ fn consume_form(input: &[u8]) -> Option<(Vec<Expression<'_>>, &[u8])> {
     }
 }
 
+// A vector literal's items are data, like a quoted list's
+fn consume_vector(input: &[u8]) -> Option<(Vec<Expression<'_>>, &[u8])> {
+    if let Some(input) = consume_bytes(input, b"#") {
+        consume_form(input, consume_datum)
+    } else {
+        None
+    }
+}
+
 fn consume_bytes<'a>(input: &'a [u8], pattern: &'a [u8]) -> Option<&'a [u8]> {
     if input.starts_with(pattern) {
         Some(&input[pattern.len()..])
@@ -264,21 +289,43 @@ fn consume_expression(input: &[u8]) -> Option<(Expression<'_>, &[u8])> {
         Some((Expression::Char(v), input))
     } else if let Some((sym, input)) = consume_symbol(input) {
         Some((Expression::Symbol(sym), input))
-    } else if let Some((args, input)) = consume_form(input) {
+    } else if let Some((datum, input)) = consume_quote(input) {
+        Some((datum, input))
+    } else if let Some((args, input)) = consume_form(input, consume_expression) {
         Some((Expression::Form(args), input))
+    } else if let Some((items, input)) = consume_vector(input) {
+        Some((Expression::Vector(items), input))
     } else if let Some((v, input)) = consume_string_literal(input) {
         Some((Expression::String(v), input))
-    } else if let Some(input) = consume_null(input) {
-        Some((Expression::Null, input))
     } else {
         None
     }
 }
 
-fn consume_expressions(mut input: &[u8]) -> (Vec<Expression<'_>>, &[u8]) {
+// Like consume_expression, except that lists can have a . before their tail
+fn consume_datum(input: &[u8]) -> Option<(Expression<'_>, &[u8])> {
+    if let Some(input) = consume_bytes(input, b".")
+        && starts_with_delimiter(input)
+    {
+        Some((Expression::Dot, input))
+    } else if let Some((items, input)) = consume_form(input, consume_datum) {
+        Some((Expression::Form(items), input))
+    } else {
+        consume_expression(input)
+    }
+}
+
+fn consume_expressions(input: &[u8]) -> (Vec<Expression<'_>>, &[u8]) {
+    consume_items(input, consume_expression)
+}
+
+fn consume_items(
+    mut input: &[u8],
+    consume_item: fn(&[u8]) -> Option<(Expression<'_>, &[u8])>,
+) -> (Vec<Expression<'_>>, &[u8]) {
     let mut result = Vec::new();
     while !input.is_empty()
-        && let Some((exp, new_input)) = consume_expression(input)
+        && let Some((exp, new_input)) = consume_item(input)
     {
         result.push(exp);
         input = consume_whitespace(new_input);
@@ -290,7 +337,7 @@ fn lower_let<'a>(
     mut args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     let mut result = Vec::new();
     if let Expression::Form(bindings) = args.remove(0) {
         let mut new_bindings = HashMap::new();
@@ -319,7 +366,7 @@ fn lower_let<'a>(
         let new_env = &mut env.clone();
         new_env.extend(new_bindings.drain());
         result.append(&mut lower_expressions(args, new_env, stack_slots_used));
-        result.push(format!("FALL {num_bindings}"));
+        result.push(Instruction::new("FALL", Operand::Count(num_bindings)));
     } else {
         panic!("let bindings is not a form")
     }
@@ -330,30 +377,60 @@ fn lower_begin<'a>(
     args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     if args.is_empty() {
         // Technically wrong; whether begin allows 0 args is context-dependent
-        vec!["LOAD UNSPECIFIED".to_owned()]
+        vec![Instruction::new("LOAD", Operand::Value(Value::Unspecified))]
     } else {
         lower_expressions(args, env, stack_slots_used)
     }
 }
 
+// Lowers the condition of an if, leaving whatever its branch consumes on the
+// stack, and returns the branch to follow it with. Primitive predicates get a
+// branch that tests their operands directly instead of a boolean.
+fn lower_condition<'a>(
+    cond: Expression<'a>,
+    env: &HashMap<&'a [u8], usize>,
+    stack_slots_used: usize,
+) -> (Vec<Instruction>, &'static str) {
+    if let Expression::Form(args) = &cond
+        && let Some(Expression::Symbol(name)) = args.first()
+        && !env.contains_key(name)
+    {
+        let branch = match (*name, args.len() - 1) {
+            (b"<", 2) => Some("BRANCH_IF_NOT_LT"),
+            (b"=", 2) => Some("BRANCH_IF_NOT_EQ"),
+            (b"zero?", 1) => Some("BRANCH_IF_NOT_ZERO"),
+            (b"null?", 1) => Some("BRANCH_IF_NOT_NULL"),
+            _ => None,
+        };
+        if let Some(branch) = branch
+            && let Expression::Form(mut args) = cond
+        {
+            args.remove(0);
+            let mut result = Vec::new();
+            // Same order as lower_variadic_primitive: first argument on top
+            for (i, arg) in args.into_iter().rev().enumerate() {
+                result.append(&mut lower_expression(arg, env, stack_slots_used + i));
+            }
+            return (result, branch);
+        }
+    }
+    (
+        lower_expression(cond, env, stack_slots_used),
+        "BRANCH_IF_FALSE",
+    )
+}
+
 fn lower_if<'a>(
     mut args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
-    let mut result = Vec::new();
-    let mut stack_slots_used = stack_slots_used;
+) -> Vec<Instruction> {
     assert!(matches!(args.len(), 2 | 3), "Invalid argument count to if");
-    // cond
-    result.append(&mut lower_expression(args.remove(0), env, stack_slots_used));
-    stack_slots_used += 1; // cond
-    result.push("LOAD #f".to_owned());
-    stack_slots_used += 1; // load
-    result.push("EQP 2".to_owned());
-    stack_slots_used -= 1; // eqp
+    // cond (the branch pops everything it pushes)
+    let (mut result, branch) = lower_condition(args.remove(0), env, stack_slots_used);
 
     // consequent
     let mut consequent_code = lower_expression(args.remove(0), env, stack_slots_used);
@@ -362,12 +439,18 @@ fn lower_if<'a>(
     let mut alternative_code = if let Some(alternative_code) = args.pop() {
         lower_expression(alternative_code, env, stack_slots_used)
     } else {
-        vec!["LOAD UNSPECIFIED".to_owned()]
+        vec![Instruction::new("LOAD", Operand::Value(Value::Unspecified))]
     };
 
-    consequent_code.push("JUMP ".to_owned() + &alternative_code.len().to_string());
+    consequent_code.push(Instruction::new(
+        "JUMP",
+        Operand::Jump(alternative_code.len() as i64),
+    ));
 
-    result.push("CJUMP ".to_owned() + &consequent_code.len().to_string());
+    result.push(Instruction::new(
+        branch,
+        Operand::Jump(consequent_code.len() as i64),
+    ));
     result.append(&mut consequent_code);
     result.append(&mut alternative_code);
     result
@@ -377,28 +460,27 @@ fn lower_list<'a>(
     args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     mut stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
+    if args.is_empty() {
+        return vec![Instruction::new("LOAD", Operand::Value(Value::Null))];
+    }
     let mut result = Vec::new();
-    stack_slots_used += 1;
     let num_args = args.len();
     for arg in args {
         result.append(&mut lower_expression(arg, env, stack_slots_used));
         stack_slots_used += 1;
     }
-    result.push("LOAD NULL".to_owned());
-    for _ in 0..num_args {
-        result.push("CONS".to_owned());
-    }
+    result.push(Instruction::new("LIST", Operand::Count(num_args)));
     result
 }
 
 fn lower_nary_primitive<'a>(
-    mnemonic: &str,
+    mnemonic: &'static str,
     n: usize,
     args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     let mut result = Vec::new();
     assert!(
         args.len() == n,
@@ -407,27 +489,79 @@ fn lower_nary_primitive<'a>(
     for arg in args {
         result.append(&mut lower_expression(arg, env, stack_slots_used));
     }
-    result.push(mnemonic.to_owned());
+    result.push(Instruction::new(mnemonic, Operand::None));
     result
 }
 
+// The instruction that does what mnemonic does to two arguments, taking the
+// second from an integer immediate, and whether the arguments commute (so that
+// a literal first argument can be the immediate too).
+fn immediate_form(mnemonic: &str) -> Option<(&'static str, bool)> {
+    match mnemonic {
+        "ADD" => Some(("ADDI", true)),
+        "SUB" => Some(("SUBI", false)),
+        "MUL" => Some(("MULI", true)),
+        "LT" => Some(("LTI", false)),
+        "EQ" => Some(("EQI", true)),
+        _ => None,
+    }
+}
+
+// The instruction that does what mnemonic does to exactly two arguments,
+// without an arity to loop over.
+fn binary_form(mnemonic: &str) -> Option<&'static str> {
+    match mnemonic {
+        "ADD" => Some("ADD2"),
+        "SUB" => Some("SUB2"),
+        "MUL" => Some("MUL2"),
+        "LT" => Some("LT2"),
+        "EQ" => Some("EQ2"),
+        "EQP" => Some("EQP2"),
+        _ => None,
+    }
+}
+
 fn lower_variadic_primitive<'a>(
     min_args: usize,
-    mnemonic: &str,
-    args: Vec<Expression<'a>>,
+    mnemonic: &'static str,
+    mut args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     let mut result = Vec::new();
     let num_args = args.len();
     assert!(
         num_args >= min_args,
         "Too few arguments provided to variadic primitive"
     );
+    if num_args == 2
+        && let Some((immediate_mnemonic, commutative)) = immediate_form(mnemonic)
+    {
+        if commutative
+            && matches!(args[0], Expression::Int(_))
+            && !matches!(args[1], Expression::Int(_))
+        {
+            args.swap(0, 1);
+        }
+        if let Expression::Int(k) = args[1] {
+            args.pop();
+            let mut result = lower_expression(args.pop().unwrap(), env, stack_slots_used);
+            result.push(Instruction::new(
+                immediate_mnemonic,
+                Operand::Value(Value::Int(k)),
+            ));
+            return result;
+        }
+    }
     for (i, arg) in args.into_iter().rev().enumerate() {
         result.append(&mut lower_expression(arg, env, stack_slots_used + i));
     }
-    result.push(format!("{mnemonic} {num_args}"));
+    match binary_form(mnemonic) {
+        Some(binary_mnemonic) if num_args == 2 => {
+            result.push(Instruction::new(binary_mnemonic, Operand::None))
+        }
+        _ => result.push(Instruction::new(mnemonic, Operand::Count(num_args))),
+    }
     result
 }
 
@@ -435,7 +569,7 @@ fn lower_form<'a>(
     mut args: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     assert!(!args.is_empty(), "Empty form!");
     if let Expression::Symbol(name) = args.remove(0) {
         if env.contains_key(name) {
@@ -477,6 +611,10 @@ fn lower_form<'a>(
             b"car" => lower_nary_primitive("CAR", 1, args, env, stack_slots_used),
             b"cdr" => lower_nary_primitive("CDR", 1, args, env, stack_slots_used),
             b"list" => lower_list(args, env, stack_slots_used),
+            b"quote" => {
+                assert!(args.len() == 1, "quote takes exactly one datum");
+                lower_quote(args.remove(0))
+            }
             _ => panic!("Cannot resolve symbol '{name:?}'"),
         }
     } else {
@@ -488,16 +626,17 @@ fn lower_expression<'a>(
     exp: Expression<'a>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     match exp {
-        Expression::Int(x) => vec!["LOAD ".to_owned() + &x.to_string()],
-        Expression::Char(x) => vec![format!("LOAD #\\x{x:x}")],
-        Expression::Bool(x) => vec!["LOAD ".to_owned() + if x { "#t" } else { "#f" }],
+        Expression::Int(x) => vec![Instruction::new("LOAD", Operand::Value(Value::Int(x)))],
+        Expression::Char(x) => vec![Instruction::new("LOAD", Operand::Value(Value::Char(x)))],
+        Expression::Bool(x) => vec![Instruction::new("LOAD", Operand::Value(Value::Bool(x)))],
         Expression::Form(args) => lower_form(args, env, stack_slots_used),
-        Expression::Null => vec!["LOAD NULL".to_owned()],
+        Expression::Quote(datum) => lower_quote(*datum),
+        Expression::Vector(_) => vec![Instruction::new("LOAD", Operand::Datum(datum(&exp)))],
         Expression::Symbol(name) => {
             if let Some(env_index) = env.get(name) {
-                vec!["GET ".to_owned() + &env_index.to_string()]
+                vec![Instruction::new("GET", Operand::Count(*env_index))]
             } else {
                 panic!(
                     "Couldn't find environment entry for \"{}\"",
@@ -505,13 +644,67 @@ fn lower_expression<'a>(
                 )
             }
         }
-        Expression::String(v) => lower_variadic_primitive(
-            0,
-            "STRING",
-            v.into_iter().map(Expression::Char).collect(),
-            env,
-            stack_slots_used,
-        ),
+        Expression::String(v) => vec![Instruction::new("STRINGLIT", Operand::String(v))],
+        Expression::Dot => unreachable!("Only data contain dots"),
+    }
+}
+
+// Quoted atoms are just their values, and quoted strings are copied like string
+// literals. Anything else is laid out in the bytecode's data section by the
+// assembler, so that it's built once, and a LOAD of it is a pointer. Vector
+// literals are self-evaluating, so they're always lowered like this.
+fn lower_quote(quoted: Expression) -> Vec<Instruction> {
+    match quoted {
+        Expression::Form(items) if items.is_empty() => {
+            vec![Instruction::new("LOAD", Operand::Value(Value::Null))]
+        }
+        Expression::Form(_) => vec![Instruction::new("LOAD", Operand::Datum(datum(&quoted)))],
+        Expression::Symbol(_) | Expression::Quote(_) => {
+            panic!("Quoted symbols are not supported yet")
+        }
+        Expression::Dot => panic!("Misplaced . in quoted datum"),
+        atom => lower_expression(atom, &HashMap::new(), 0),
+    }
+}
+
+// A quoted list or a vector literal, as LOAD loads it from the data section
+fn datum(quoted: &Expression) -> Datum {
+    match quoted {
+        Expression::Int(x) => Datum::Value(Value::Int(*x)),
+        Expression::Bool(x) => Datum::Value(Value::Bool(*x)),
+        Expression::Char(x) => Datum::Value(Value::Char(*x)),
+        Expression::String(v) => Datum::String(v.clone()),
+        Expression::Form(items) => {
+            let (cars, tail) = match items
+                .iter()
+                .position(|item| matches!(item, Expression::Dot))
+            {
+                Some(dot) => {
+                    assert!(
+                        dot != 0 && dot + 2 == items.len(),
+                        "Misplaced . in quoted list"
+                    );
+                    (&items[..dot], datum(&items[dot + 1]))
+                }
+                None => (&items[..], Datum::Value(Value::Null)),
+            };
+            if cars.is_empty() {
+                tail
+            } else {
+                Datum::List(cars.iter().map(datum).collect(), Box::new(tail))
+            }
+        }
+        Expression::Vector(items) => {
+            assert!(
+                !items.iter().any(|item| matches!(item, Expression::Dot)),
+                "Misplaced . in vector"
+            );
+            Datum::Vector(items.iter().map(datum).collect())
+        }
+        Expression::Symbol(_) | Expression::Quote(_) => {
+            panic!("Quoted symbols are not supported yet")
+        }
+        Expression::Dot => panic!("Misplaced . in quoted list"),
     }
 }
 
@@ -519,19 +712,19 @@ fn lower_expressions<'a>(
     exps: Vec<Expression<'a>>,
     env: &HashMap<&'a [u8], usize>,
     stack_slots_used: usize,
-) -> Vec<String> {
+) -> Vec<Instruction> {
     let mut result = Vec::new();
     let num_exps = exps.len();
     for (i, exp) in exps.into_iter().enumerate() {
         result.append(&mut lower_expression(exp, env, stack_slots_used));
         if i != num_exps - 1 {
-            result.push("FORGET".to_owned());
+            result.push(Instruction::new("FORGET", Operand::None));
         }
     }
     result
 }
 
-fn compile_all(input_slice: &[u8]) -> Vec<String> {
+fn compile_all(input_slice: &[u8]) -> Vec<Instruction> {
     let (ast, input_slice) = consume_expressions(consume_whitespace(input_slice));
     // dbg!(&ast);
     assert!(
@@ -541,10 +734,46 @@ fn compile_all(input_slice: &[u8]) -> Vec<String> {
     lower_expressions(ast, &HashMap::new(), 0)
 }
 
+// Written by the interpreter's build: each handler's name and address
+const OPCODES_PATH: &str = concat!(env!("CARGO_MANIFEST_DIR"), "/../interpreter/opcodes.txt");
+// Written by assembler/superinstructions.py
+const GENERATED_PATH: &str = concat!(
+    env!("CARGO_MANIFEST_DIR"),
+    "/../assembler/superinstructions.txt"
+);
+
+// Compiles stdin to assembly on stdout, or with --emit=bytecode, straight to
+// bytecode for the interpreter whose opcodes.txt follows it (by default, the
+// one in this repository).
 fn main() {
+    let args: Vec<String> = args().skip(1).collect();
+    let (emit_bytecode, opcodes_path) = match &args[..] {
+        [] => (false, None),
+        [emit] if emit == "--emit=assembly" => (false, None),
+        [emit] if emit == "--emit=bytecode" => (true, None),
+        [emit, path] if emit == "--emit=bytecode" => (true, Some(path.as_str())),
+        _ => panic!("Usage: compiler [--emit=assembly | --emit=bytecode [opcodes.txt]]"),
+    };
     let mut input_vec = Vec::new();
     let _bytes_read = stdin().read_to_end(&mut input_vec);
-    println!("{}", compile_all(&input_vec[..]).join("\n"));
+    let instructions = compile_all(&input_vec[..]);
+    if emit_bytecode {
+        let opcodes_path = opcodes_path.unwrap_or(OPCODES_PATH);
+        let opcodes = bytecode::read_opcodes(
+            &read_to_string(opcodes_path)
+                .unwrap_or_else(|e| panic!("Couldn't read {opcodes_path}: {e}")),
+        );
+        let generated = bytecode::read_generated(
+            &read_to_string(GENERATED_PATH).unwrap_or_default(),
+            &opcodes,
+        );
+        stdout()
+            .write_all(&bytecode::assemble(&instructions, &opcodes, &generated))
+            .expect("Couldn't write bytecode");
+    } else {
+        let assembly: Vec<String> = instructions.iter().map(ToString::to_string).collect();
+        println!("{}", assembly.join("\n"));
+    }
 }
 
 #[test]
@@ -630,3 +859,136 @@ fn mismatched_nested_comment() {
 fn numeric_symbol() {
     compile_all(b"(let ((1 0)) 1)");
 }
+
+#[test]
+fn if_fuses_primitive_predicates() {
+    assert_eq!(
+        compile_all(b"(if (< 1 2) 3 4)"),
+        [
+            "LOAD 2",
+            "LOAD 1",
+            "BRANCH_IF_NOT_LT 2",
+            "LOAD 3",
+            "JUMP 1",
+            "LOAD 4"
+        ]
+    );
+    assert_eq!(
+        compile_all(b"(if (null? 1) 2)"),
+        [
+            "LOAD 1",
+            "BRANCH_IF_NOT_NULL 2",
+            "LOAD 2",
+            "JUMP 1",
+            "LOAD UNSPECIFIED"
+        ]
+    );
+}
+
+#[test]
+fn if_branches_on_false() {
+    assert_eq!(
+        compile_all(b"(if (< 1 2 3) 4 5)"),
+        [
+            "LOAD 3",
+            "LOAD 2",
+            "LOAD 1",
+            "LT 3",
+            "BRANCH_IF_FALSE 2",
+            "LOAD 4",
+            "JUMP 1",
+            "LOAD 5"
+        ]
+    );
+}
+
+#[test]
+fn literal_operands_become_immediates() {
+    assert_eq!(
+        compile_all(b"(+ 1 (- (* 2 3) 4))"),
+        ["LOAD 2", "MULI 3", "SUBI 4", "ADDI 1"]
+    );
+    // < and - don't commute
+    assert_eq!(
+        compile_all(b"(< 1 (= 2 3))"),
+        ["LOAD 2", "EQI 3", "LOAD 1", "LT2"]
+    );
+}
+
+#[test]
+fn two_arguments_use_binary_forms() {
+    assert_eq!(
+        compile_all(b"(eq? (+ (+) (+)) (+ (+) (+) (+)))"),
+        [
+            "ADD 0", "ADD 0", "ADD 0", "ADD 3", "ADD 0", "ADD 0", "ADD2", "EQP2"
+        ]
+    );
+}
+
+#[test]
+fn string_literals_are_constants() {
+    assert_eq!(
+        compile_all(b"\"a \\\"b\\\" \\\\ \\n\""),
+        ["STRINGLIT \"a \\\"b\\\" \\\\ \\x0a\""]
+    );
+}
+
+#[test]
+fn quoted_data_are_constants() {
+    assert_eq!(
+        compile_all(b"(list '() '1 (quote (1 #\\a \"b\" (() . #t))))"),
+        [
+            "LOAD NULL",
+            "LOAD 1",
+            "LOAD (1 #\\x61 \"b\" (() . #t))",
+            "LIST 3"
+        ]
+    );
+}
+
+#[test]
+fn vector_literals_are_constants() {
+    assert_eq!(
+        compile_all(b"(list #() '#(1 (#\\a . \"b\")) #(#(#t)))"),
+        [
+            "LOAD #()",
+            "LOAD #(1 (#\\x61 . \"b\"))",
+            "LOAD #(#(#t))",
+            "LIST 3"
+        ]
+    );
+}
+
+#[test]
+fn lists_are_built_at_once() {
+    assert_eq!(
+        compile_all(b"(list (list) (let ((x 1)) x) (list 2))"),
+        [
+            "LOAD NULL",
+            "LOAD 1",
+            "GET 1",
+            "FALL 1",
+            "LOAD 2",
+            "LIST 1",
+            "LIST 3"
+        ]
+    );
+}
+
+#[test]
+#[should_panic(expected = "Misplaced . in quoted list")]
+fn misplaced_dot() {
+    compile_all(b"'(1 . 2 3)");
+}
+
+#[test]
+#[should_panic(expected = "Misplaced . in vector")]
+fn dot_in_vector() {
+    compile_all(b"'#(1 . 2)");
+}
+
+#[test]
+#[should_panic(expected = "Parsing failed")]
+fn dot_is_not_a_symbol() {
+    compile_all(b"(let ((. 1)) .)");
+}
@@ -27,9 +27,42 @@
 #define VECTOR_MASK 0b111
 #define VECTOR_SUFFIX 0b010
 
+// Strings and vectors start with a header word holding their length.
+// Headers end in 110, which no value does, so the collector can tell a header
+// apart from the car of a pair when it walks to-space.
+#define HEADER_MASK 0b111
+#define HEADER_SUFFIX 0b110
+#define HEADER_LENGTH_SHIFT 4
+
+#define STRING_HEADER_MASK 0b1111
+#define STRING_HEADER_SUFFIX 0b0110
+
+#define VECTOR_HEADER_MASK 0b1111
+#define VECTOR_HEADER_SUFFIX 0b1110
+
+// The collector overwrites the first word of every object it copies with the
+// address of the copy, tagged like this. No value or header ends in 101.
+#define FORWARDING_MASK 0b111
+#define FORWARDING_SUFFIX 0b101
+
+#define PAIR_SIZE 16
+
 #define STACK_SLOT_SIZE 8
 
-#define INSTRUCTION_SIZE 16
+#define OPCODE_SIZE 8
 #define IMMEDIATE_SIZE 8
 
 #define PAGESIZE 0x1000
+
+#define BYTECODE_RESERVATION 0x40000000
+
+// Bytes of VM stack, not counting its guard page. Override with
+// make CFLAGS+=-DVM_STACK_SIZE=...
+#ifndef VM_STACK_SIZE
+#define VM_STACK_SIZE 0x100000
+#endif
+
+// Each semispace reserves this much address space up front, but only commits
+// (makes accessible) as much of it as the live data calls for.
+#define SEMISPACE_RESERVATION 0x100000000
+#define SEMISPACE_INITIAL_SIZE 0x100000
@@ -0,0 +1,143 @@
+#include "gc.h"
+#include "constants.h"
+#include "libc.h"
+
+// A Cheney-style copying collector.
+// The interpreter allocates downward from the top of from_space. Collection
+// copies everything reachable from the VM stack into the bottom of to_space,
+// then the two spaces trade places.
+static uint8_t *from_space;
+static uint8_t *to_space;
+static uint8_t *to_space_free;
+
+// How much of each semispace is accessible. Always a multiple of PAGESIZE.
+static size_t semispace_size;
+
+[[noreturn]] static void heap_exhausted(void) {
+    static char const message[] = "heap exhausted\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    exit(EXIT_FAILURE);
+}
+
+// Makes the first size bytes of both semispaces accessible.
+static void grow_semispaces(size_t const size) {
+    if (size > SEMISPACE_RESERVATION) {
+        heap_exhausted();
+    }
+    if (mprotect(from_space, size, PROT_READ | PROT_WRITE) != 0 ||
+        mprotect(to_space, size, PROT_READ | PROT_WRITE) != 0) {
+        heap_exhausted();
+    }
+    semispace_size = size;
+}
+
+struct heap gc_init(uint8_t *const space_a, uint8_t *const space_b) {
+    from_space = space_a;
+    to_space = space_b;
+    grow_semispaces(SEMISPACE_INITIAL_SIZE);
+    return (struct heap){.hp = from_space + semispace_size,
+                         .limit = from_space};
+}
+
+// Returns v's tag if it points to a heap object, and 0 otherwise.
+static uint64_t pointer_tag(uint64_t const v) {
+    if ((v & PAIR_MASK) == PAIR_SUFFIX) {
+        return PAIR_SUFFIX;
+    }
+    if ((v & STRING_MASK) == STRING_SUFFIX) {
+        return STRING_SUFFIX;
+    }
+    if ((v & VECTOR_MASK) == VECTOR_SUFFIX) {
+        return VECTOR_SUFFIX;
+    }
+    return 0;
+}
+
+static bool in_from_space(uint64_t const *const object) {
+    uint8_t const *const p = (uint8_t const *)object;
+    return from_space <= p && p < from_space + semispace_size;
+}
+
+static size_t headed_object_size(uint64_t const header) {
+    uint64_t const len = header >> HEADER_LENGTH_SHIFT;
+    if ((header & STRING_HEADER_MASK) == STRING_HEADER_SUFFIX) {
+        return sizeof(header) + ((len + 7) & -8ull);
+    }
+    return sizeof(header) + len * sizeof(uint64_t);
+}
+
+// Copies the object that v points to into to-space (unless that already
+// happened), and returns v retagged to point at the copy.
+static uint64_t forward(uint64_t const v) {
+    uint64_t const tag = pointer_tag(v);
+    uint64_t *const object = (uint64_t *)(v - tag);
+    if (tag == 0 || !in_from_space(object)) {
+        return v;
+    }
+    if ((object[0] & FORWARDING_MASK) == FORWARDING_SUFFIX) {
+        return (object[0] - FORWARDING_SUFFIX) | tag;
+    }
+
+    size_t const size =
+        tag == PAIR_SUFFIX ? PAIR_SIZE : headed_object_size(object[0]);
+    uint64_t *const copy = (uint64_t *)to_space_free;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+        copy[i] = object[i];
+    }
+    to_space_free += size;
+
+    object[0] = (uint64_t)copy | FORWARDING_SUFFIX;
+    return (uint64_t)copy | tag;
+}
+
+struct heap collect_garbage(uint64_t *const sp, uint64_t const slots_used,
+                            size_t const bytes_needed) {
+    to_space_free = to_space;
+    for (uint64_t i = 0; i < slots_used; i++) {
+        sp[i] = forward(sp[i]);
+    }
+
+    // Everything between scan and to_space_free has been copied, but its
+    // fields still point into from-space.
+    uint8_t *scan = to_space;
+    while (scan < to_space_free) {
+        uint64_t *const object = (uint64_t *)scan;
+        if ((object[0] & HEADER_MASK) != HEADER_SUFFIX) {
+            // Pairs are the only objects without a header.
+            object[0] = forward(object[0]);
+            object[1] = forward(object[1]);
+            scan += PAIR_SIZE;
+            continue;
+        }
+        if ((object[0] & VECTOR_HEADER_MASK) == VECTOR_HEADER_SUFFIX) {
+            uint64_t const len = object[0] >> HEADER_LENGTH_SHIFT;
+            for (uint64_t i = 1; i <= len; i++) {
+                object[i] = forward(object[i]);
+            }
+        }
+        scan += headed_object_size(object[0]);
+    }
+
+    uint8_t *const old_from_space = from_space;
+    from_space = to_space;
+    to_space = old_from_space;
+
+    // Keep the heap at most half full after a collection, so that the next
+    // one doesn't come too soon.
+    size_t const live = to_space_free - from_space;
+    size_t new_size = semispace_size;
+    while (new_size < SEMISPACE_RESERVATION &&
+           new_size / 2 < live + bytes_needed) {
+        new_size *= 2;
+    }
+    if (new_size != semispace_size) {
+        grow_semispaces(new_size);
+    }
+
+    struct heap const result = {.hp = from_space + semispace_size,
+                                .limit = to_space_free};
+    if ((size_t)(result.hp - result.limit) < bytes_needed) {
+        heap_exhausted();
+    }
+    return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "libc.h"
+
+// The part of the heap that the interpreter is allowed to allocate from.
+// Allocation bumps hp down toward limit.
+struct heap {
+    uint8_t *hp;
+    uint8_t *limit;
+};
+
+// Takes ownership of two SEMISPACE_RESERVATION-sized reservations, which
+// don't need to be accessible yet.
+struct heap gc_init(uint8_t *space_a, uint8_t *space_b);
+
+// Called from the interpreter when an allocation of bytes_needed doesn't fit.
+// The slots_used values starting at sp are the only roots, and are updated in
+// place to point at the copies.
+struct heap collect_garbage(uint64_t *sp, uint64_t slots_used,
+                            size_t bytes_needed);
@@ -1,8 +1,11 @@
 #define _GNU_SOURCE
 
 #include "constants.h"
+#include "gc.h"
 #include "interpreter.h"
 #include "libc.h"
+#include "output.h"
+#include "verifier.h"
 
 static void *mmap_or_die(void *const addr, size_t const len, int const prot,
                          int const flags, int const fd, off_t const off) {
@@ -13,15 +16,52 @@ static void *mmap_or_die(void *const addr, size_t const len, int const prot,
     return result;
 }
 
-void _start(void) {
-    size_t capacity = PAGESIZE;
-    unsigned char *const bytecode =
-        mmap_or_die(NULL, capacity, PROT_READ | PROT_WRITE,
-                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+// The code comes first, then the data section that instructions like STRINGLIT
+// refer to, then the relocations, then a word holding how many relocations
+// there are and one holding the data section's size.
+struct bytecode {
+    uint8_t *code;
+    size_t size;
+    size_t mapped_size; // a multiple of PAGESIZE
+    size_t code_size;
+    size_t data_size;
+    uint64_t const *relocations;
+    size_t relocation_count;
+};
+
+// Regular files are mapped directly. The mapping is private, so the verifier
+// can rewrite opcodes without touching the file. Anything else (pipes) is read
+// into a reservation, which is made accessible in doubling chunks as it fills.
+static struct bytecode load_bytecode(int const fd) {
+    off_t const file_size = lseek(fd, 0, SEEK_END);
+    if (file_size > 0) {
+        uint8_t *const code = mmap_or_die(NULL, file_size,
+                                          PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                          fd, 0);
+        return (struct bytecode){
+            .code = code,
+            .size = file_size,
+            .mapped_size = (file_size + PAGESIZE - 1) & -PAGESIZE,
+        };
+    }
+
+    uint8_t *const code =
+        mmap_or_die(NULL, BYTECODE_RESERVATION, PROT_NONE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    size_t capacity = 0;
     size_t bytes_read = 0;
     while (true) {
+        if (bytes_read == capacity) {
+            size_t const new_capacity = capacity == 0 ? PAGESIZE : 2 * capacity;
+            if (new_capacity > BYTECODE_RESERVATION ||
+                mprotect(code + capacity, new_capacity - capacity,
+                         PROT_READ | PROT_WRITE) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            capacity = new_capacity;
+        }
         ssize_t const read_rc =
-            read(STDIN_FILENO, bytecode + bytes_read, capacity - bytes_read);
+            read(fd, code + bytes_read, capacity - bytes_read);
         if (read_rc < 0) {
             exit(EXIT_FAILURE);
         }
@@ -29,133 +69,324 @@ void _start(void) {
             break;
         }
         bytes_read += read_rc;
-        if (bytes_read == capacity) {
-            mmap_or_die(bytecode + capacity, PAGESIZE, PROT_READ | PROT_WRITE,
-                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE, -1,
-                        0);
-            capacity += PAGESIZE;
-        }
     }
+    return (struct bytecode){
+        .code = code,
+        .size = bytes_read,
+        .mapped_size = capacity,
+    };
+}
 
-    if (mprotect(bytecode, capacity, PROT_READ) != 0) {
+// Fills in where bytecode's sections are.
+static struct bytecode find_sections_or_die(struct bytecode bytecode) {
+    uint64_t const *const words = (uint64_t const *)bytecode.code;
+    size_t const word_count = bytecode.size / OPCODE_SIZE;
+    if (bytecode.size % OPCODE_SIZE != 0 || word_count < 2) {
         exit(EXIT_FAILURE);
     }
-
-    uint8_t *const stack =
-        mmap_or_die(NULL, PAGESIZE, PROT_READ | PROT_WRITE,
-                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_GROWSDOWN, -1, 0);
-    interpret(bytecode, stack + PAGESIZE);
+    uint64_t const data_size = words[word_count - 1];
+    uint64_t const relocation_count = words[word_count - 2];
+    if (relocation_count > word_count - 2 || data_size % OPCODE_SIZE != 0 ||
+        data_size / OPCODE_SIZE > word_count - 2 - relocation_count) {
+        exit(EXIT_FAILURE);
+    }
+    bytecode.relocations = &words[word_count - 2 - relocation_count];
+    bytecode.relocation_count = relocation_count;
+    bytecode.data_size = data_size;
+    bytecode.code_size = (uint8_t const *)bytecode.relocations -
+                         bytecode.code - data_size;
+    return bytecode;
 }
 
-static void write_or_die(int const fd, void const *const buf,
-                         size_t const len) {
-    ssize_t const write_rc = write(fd, buf, len);
-    if (write_rc < 0 || (write_rc == 0 && len > 0)) {
-        exit(EXIT_FAILURE);
+// Each relocation is the offset of a word in the code or data section that
+// holds an offset from the start of the bytecode, such as a pointer to quoted
+// data. Adding the bytecode's address makes it a real pointer.
+static void relocate_or_die(struct bytecode const *const bytecode) {
+    for (size_t i = 0; i < bytecode->relocation_count; i++) {
+        uint64_t const offset = bytecode->relocations[i];
+        if (offset >= bytecode->code_size + bytecode->data_size ||
+            offset % OPCODE_SIZE != 0) {
+            exit(EXIT_FAILURE);
+        }
+        *(uint64_t *)(bytecode->code + offset) += (uint64_t)bytecode->code;
     }
 }
 
-#define PRINT_STRING_LITERAL(S) write_or_die(STDOUT_FILENO, S, sizeof(S) - 1)
+// The data section, which STRINGLIT's checked handler keeps its operand within
+uint8_t const *data_start;
+uint8_t const *data_end;
 
-static void print_char_or_die(char const c) {
-    write_or_die(STDOUT_FILENO, &c, sizeof(c));
+#ifdef PROFILE
+// NEXT counts each instruction at this offset from its opcode.
+int64_t profile_offset;
+static uint64_t const *profile_counts;
+static size_t profile_size;
+static int profile_fd;
+
+static void write_profile(void) {
+    uint8_t const *remaining = (uint8_t const *)profile_counts;
+    size_t len = profile_size;
+    while (len > 0) {
+        ssize_t const write_rc = write(profile_fd, remaining, len);
+        if (write_rc <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        remaining += write_rc;
+        len -= write_rc;
+    }
 }
+#endif
 
-static void print_i64_or_die(int64_t v) {
-    if (v == INT64_MIN) {
-        // Not safe to negate INT64_MIN, so handle specially
-        PRINT_STRING_LITERAL("-9223372036854775808");
-        return;
+// usage: interpreter [bytecode file]
+// Reads the bytecode from stdin if there's no file.
+// The profiling build's usage is interpreter bytecode-file profile-file
+// instead. When the program finishes, it writes how many times each word of
+// the bytecode ran as an opcode to profile-file, as a uint64_t per word.
+int main(int const argc, char *const *const argv) {
+#ifdef PROFILE
+    if (argc != 3) {
+        exit(EXIT_FAILURE);
+    }
+    profile_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (profile_fd < 0) {
+        exit(EXIT_FAILURE);
     }
-    if (v == 0) {
-        // The algorithm below only works for nonzero values
-        PRINT_STRING_LITERAL("0");
-        return;
+#else
+    if (argc > 2) {
+        exit(EXIT_FAILURE);
     }
+#endif
+    int fd = STDIN_FILENO;
+    if (argc >= 2) {
+        fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct bytecode const bytecode = find_sections_or_die(load_bytecode(fd));
+    relocate_or_die(&bytecode);
+    data_start = bytecode.code + bytecode.code_size;
+    data_end = data_start + bytecode.data_size;
+#ifdef PROFILE
+    uint8_t *const counts =
+        mmap_or_die(NULL, bytecode.mapped_size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    profile_counts = (uint64_t const *)counts;
+    profile_size = bytecode.size;
+    profile_offset = counts - bytecode.code;
+#endif
 
-    static char result[21 /* len(str(-(2**63 - 1))) */];
+    // The spare slot at the top of the stack (see interpreter.S) doesn't count
+    verify(bytecode.code, bytecode.code_size, bytecode.data_size,
+           VM_STACK_SIZE / STACK_SLOT_SIZE - 1);
 
-    size_t bytes_written = 0;
-    if (v < 0) {
-        result[bytes_written] = '-';
-        bytes_written++;
-        v *= -1;
-    }
-    uint64_t const uv = v;
-    uint64_t power_of_ten = 10000000000000000000ull; // (smallest power of ten
-                                                     // greater than INT64_MAX)
-    while (power_of_ten > uv) {
-        power_of_ten /= 10;
-    }
-    power_of_ten *= 10;
-    while (power_of_ten > 1) {
-        result[bytes_written] =
-            '0' + ((uv % power_of_ten) / (power_of_ten / 10));
-        power_of_ten /= 10;
-        bytes_written++;
-    }
-    write_or_die(STDOUT_FILENO, result, bytes_written);
+    // Quoted data is in here too. It has to stay immutable, since the collector
+    // doesn't scan it for pointers into the heap, so vector-set! and
+    // string-set! on it fault.
+    if (mprotect(bytecode.code, bytecode.mapped_size, PROT_READ) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // The stack is populated up front so that it doesn't fault a page at a
+    // time as it deepens. Its lowest page is a guard, in case an unchecked
+    // handler ever pushes past the limit that the checked ones enforce.
+    uint8_t *const stack = mmap_or_die(
+        NULL, PAGESIZE + VM_STACK_SIZE, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    if (mprotect(stack, PAGESIZE, PROT_NONE) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *const stack_limit = stack + PAGESIZE;
+
+    uint8_t *const semispaces =
+        mmap_or_die(NULL, 2 * SEMISPACE_RESERVATION, PROT_NONE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    // Only a hint, so failure is fine
+    madvise(semispaces, 2 * SEMISPACE_RESERVATION, MADV_HUGEPAGE);
+    struct heap const heap =
+        gc_init(semispaces, semispaces + SEMISPACE_RESERVATION);
+
+    interpret(bytecode.code, stack_limit + VM_STACK_SIZE, heap.hp, heap.limit,
+              stack_limit);
 }
 
-static void print_value(uint64_t); // forward declaration :(
-static void print_pair_contents(uint64_t const v) {
-    uint64_t const car = *(uint64_t *)(v - 1);
-    uint64_t const cdr = *(uint64_t *)((v - 1) + 8);
-    print_value(car);
-    if (cdr != TAGGED_NULL) {
-        if ((cdr & PAIR_MASK) == PAIR_SUFFIX) {
-            PRINT_STRING_LITERAL(" ");
-            print_pair_contents(cdr);
-        } else {
-            PRINT_STRING_LITERAL(" . ");
-            print_value(cdr);
-        }
+// "00" through "99", so that digits can be formatted two at a time
+static char const digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// x / 100, computed as (x / 4) / 25 with a multiplication by ceil(2**66 / 25)
+// instead of a div. That's exact for every uint64_t x. The compiler would emit
+// a div for a plain x / 100 at -O0, which is much slower.
+static uint64_t divide_by_100(uint64_t const x) {
+    return (uint64_t)(((uint128_t)(x >> 2) * 0x28f5c28f5c28f5c3ull) >> 66);
+}
+
+static void print_i64(int64_t const v) {
+    char result[21 /* len(str(-2**63)) */];
+
+    // Fill result from the end, two digits at a time. Negating in unsigned
+    // arithmetic makes INT64_MIN safe.
+    char *start = result + sizeof(result);
+    uint64_t uv = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    while (uv >= 100) {
+        uint64_t const quotient = divide_by_100(uv);
+        uint64_t const pair = uv - quotient * 100;
+        start -= 2;
+        start[0] = digit_pairs[2 * pair];
+        start[1] = digit_pairs[2 * pair + 1];
+        uv = quotient;
     }
+    if (uv >= 10) {
+        start -= 2;
+        start[0] = digit_pairs[2 * uv];
+        start[1] = digit_pairs[2 * uv + 1];
+    } else {
+        start--;
+        start[0] = '0' + uv;
+    }
+    if (v < 0) {
+        start--;
+        start[0] = '-';
+    }
+    output_bytes(start, result + sizeof(result) - start);
 }
 
-static void print_value(uint64_t const v) {
+// Prints v if it's a value without elements. Returns false without printing
+// anything if it's a nonempty list or vector.
+static bool print_atom(uint64_t const v) {
     if ((v & INT_MASK) == INT_SUFFIX) {
         int64_t untagged_v = v >> 2;
         if (untagged_v >= 0x2000000000000000ll) {
             untagged_v += -0x4000000000000000ll;
         }
-        print_i64_or_die(untagged_v);
+        print_i64(untagged_v);
     } else if (v == TRUE) {
-        PRINT_STRING_LITERAL("#t");
+        OUTPUT_STRING_LITERAL("#t");
     } else if (v == FALSE) {
-        PRINT_STRING_LITERAL("#f");
+        OUTPUT_STRING_LITERAL("#f");
     } else if ((v & CHAR_MASK) == CHAR_SUFFIX) {
-        PRINT_STRING_LITERAL("#\\");
-        print_char_or_die((char)(v >> 8));
+        OUTPUT_STRING_LITERAL("#\\");
+        output_char((char)(v >> 8));
     } else if (v == TAGGED_NULL) {
-        PRINT_STRING_LITERAL("()");
+        OUTPUT_STRING_LITERAL("()");
     } else if ((v & PAIR_MASK) == PAIR_SUFFIX) {
-        PRINT_STRING_LITERAL("(");
-        print_pair_contents(v);
-        PRINT_STRING_LITERAL(")");
+        return false;
     } else if ((v & STRING_MASK) == STRING_SUFFIX) {
-        uint64_t const len = *(uint64_t *)(v - 3);
-        PRINT_STRING_LITERAL("\"");
-        write_or_die(STDOUT_FILENO, (void *)(v + 5), len);
-        PRINT_STRING_LITERAL("\"");
+        uint64_t const len = *(uint64_t *)(v - 3) >> HEADER_LENGTH_SHIFT;
+        OUTPUT_STRING_LITERAL("\"");
+        output_bytes((void *)(v + 5), len);
+        OUTPUT_STRING_LITERAL("\"");
     } else if ((v & VECTOR_MASK) == VECTOR_SUFFIX) {
-        uint64_t const len = *(uint64_t *)(v - 2);
-        PRINT_STRING_LITERAL("#(");
-        for (uint64_t i = 0; i < len; i++) {
-            print_value(((uint64_t *)(v - 2 + 8))[i]);
-            if (i != len - 1) {
-                PRINT_STRING_LITERAL(" ");
-            }
+        uint64_t const len = *(uint64_t *)(v - 2) >> HEADER_LENGTH_SHIFT;
+        if (len != 0) {
+            return false;
         }
-        PRINT_STRING_LITERAL(")");
+        OUTPUT_STRING_LITERAL("#()");
     } else if (v != UNSPECIFIED) {
-        PRINT_STRING_LITERAL("value is malformed.\n");
+        OUTPUT_STRING_LITERAL("value is malformed.\n");
+        output_flush();
         exit(EXIT_FAILURE);
     }
+    return true;
+}
+
+// A list or vector that print_value is partway through.
+struct print_frame {
+    uint64_t rest;  // the unprinted tail of a list, or the vector itself
+    uint64_t index; // the next element of the vector, or LIST_FRAME
+};
+#define LIST_FRAME ((uint64_t)-1)
+
+// The work stack lives on the heap so that printing takes constant native
+// stack, however long or deeply nested v is. Every frame is for a different
+// object, each at least as big as a frame, so the work stack can't outgrow a
+// semispace unless v is circular (which vector-set! can make).
+static void print_value(uint64_t v) {
+    struct print_frame *const frames =
+        mmap_or_die(NULL, SEMISPACE_RESERVATION, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    size_t const max_depth = SEMISPACE_RESERVATION / sizeof(frames[0]);
+    size_t depth = 0;
+    while (true) {
+        if (!print_atom(v)) {
+            // Open v, and go on to its first element
+            if (depth == max_depth) {
+                OUTPUT_STRING_LITERAL("value is circular.\n");
+                output_flush();
+                exit(EXIT_FAILURE);
+            }
+            if ((v & PAIR_MASK) == PAIR_SUFFIX) {
+                OUTPUT_STRING_LITERAL("(");
+                frames[depth] = (struct print_frame){
+                    .rest = *(uint64_t *)((v - 1) + 8),
+                    .index = LIST_FRAME,
+                };
+                v = *(uint64_t *)(v - 1);
+            } else {
+                OUTPUT_STRING_LITERAL("#(");
+                frames[depth] = (struct print_frame){.rest = v, .index = 1};
+                v = ((uint64_t *)(v - 2 + 8))[0];
+            }
+            depth++;
+            continue;
+        }
+
+        // v is done, so find what to print next, closing whatever's finished
+        while (true) {
+            if (depth == 0) {
+                return;
+            }
+            struct print_frame *const frame = &frames[depth - 1];
+            if (frame->index == LIST_FRAME) {
+                uint64_t const rest = frame->rest;
+                if (rest == TAGGED_NULL) {
+                    OUTPUT_STRING_LITERAL(")");
+                    depth--;
+                    continue;
+                }
+                if ((rest & PAIR_MASK) == PAIR_SUFFIX) {
+                    OUTPUT_STRING_LITERAL(" ");
+                    v = *(uint64_t *)(rest - 1);
+                    frame->rest = *(uint64_t *)((rest - 1) + 8);
+                } else {
+                    OUTPUT_STRING_LITERAL(" . ");
+                    v = rest;
+                    frame->rest = TAGGED_NULL;
+                }
+                break;
+            }
+            uint64_t const vector = frame->rest;
+            uint64_t const len =
+                *(uint64_t *)(vector - 2) >> HEADER_LENGTH_SHIFT;
+            if (frame->index == len) {
+                OUTPUT_STRING_LITERAL(")");
+                depth--;
+                continue;
+            }
+            OUTPUT_STRING_LITERAL(" ");
+            v = ((uint64_t *)(vector - 2 + 8))[frame->index];
+            frame->index++;
+            break;
+        }
+    }
 }
 
 void print_value_and_exit(uint64_t const v) {
     print_value(v);
-    PRINT_STRING_LITERAL("\n");
+    OUTPUT_STRING_LITERAL("\n");
+    output_flush();
+#ifdef PROFILE
+    write_profile();
+#endif
     exit(EXIT_SUCCESS);
 }
+
+void report_stack_overflow_and_exit(void) {
+    static char const message[] = "stack overflow\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    exit(EXIT_FAILURE);
+}
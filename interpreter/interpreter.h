@@ -1 +1,2 @@
-[[noreturn]] void interpret(void *ip, void *sp);
+[[noreturn]] void interpret(void *ip, void *sp, void *hp, void *hl,
+                            void *sl);
@@ -1,6 +1,11 @@
+#pragma once
+
 typedef unsigned long long uint64_t;
 _Static_assert(sizeof(uint64_t) == 8, "uint64_t is not 8 bytes");
 
+__extension__ typedef unsigned __int128 uint128_t;
+_Static_assert(sizeof(uint128_t) == 16, "uint128_t is not 16 bytes");
+
 typedef long long int64_t;
 _Static_assert(sizeof(int64_t) == 8, "int64_t is not 8 bytes");
 #define INT64_MIN (int64_t)(-9223372036854775807ll - 1ll)
@@ -20,7 +25,16 @@ typedef long long off_t;
 
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+
+#define O_RDONLY 0
+#define O_WRONLY 1
+#define O_CREAT 0100
+#define O_TRUNC 01000
 
+#define SEEK_END 2
+
+#define PROT_NONE 0
 #define PROT_READ 1
 #define PROT_WRITE 2
 
@@ -28,6 +42,10 @@ typedef long long off_t;
 #define MAP_PRIVATE 0x2
 #define MAP_FIXED_NOREPLACE 0x100000
 #define MAP_GROWSDOWN 0x100
+#define MAP_POPULATE 0x8000
+#define MAP_NORESERVE 0x4000
+
+#define MADV_HUGEPAGE 14
 
 #define NULL ((void *)0)
 
@@ -35,8 +53,16 @@ typedef long long off_t;
 
 void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 
+int munmap(void *addr, size_t len);
+
 int mprotect(void *addr, size_t len, int prot);
 
+int madvise(void *addr, size_t len, int advice);
+
+int open(char const *path, int flags, ...);
+
+off_t lseek(int fd, off_t offset, int whence);
+
 ssize_t read(int fd, void *buf, size_t count);
 
 ssize_t write(int fd, void const *buf, size_t count);
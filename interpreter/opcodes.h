@@ -0,0 +1,70 @@
+#pragma once
+
+#include "superinstructions.h"
+
+// Every handler in handlers.inc. X is applied to each handler's name, and to
+// how many immediates follow its opcode. The superinstructions come last: the
+// hand-written ones, then the ones generated into superinstructions.h.
+#define OPCODES(X)                                                             \
+    X(add1, 0)                                                                 \
+    X(sub1, 0)                                                                 \
+    X(add, 1)                                                                  \
+    X(sub, 1)                                                                  \
+    X(mul, 1)                                                                  \
+    X(lt, 1)                                                                   \
+    X(eq, 1)                                                                   \
+    X(addi, 1)                                                                 \
+    X(subi, 1)                                                                 \
+    X(muli, 1)                                                                 \
+    X(lti, 1)                                                                  \
+    X(eqi, 1)                                                                  \
+    X(eqp, 1)                                                                  \
+    X(add2, 0)                                                                 \
+    X(sub2, 0)                                                                 \
+    X(mul2, 0)                                                                 \
+    X(lt2, 0)                                                                  \
+    X(eq2, 0)                                                                  \
+    X(eqp2, 0)                                                                 \
+    X(load, 1)                                                                 \
+    X(zerop, 0)                                                                \
+    X(integerp, 0)                                                             \
+    X(booleanp, 0)                                                             \
+    X(charp, 0)                                                                \
+    X(nullp, 0)                                                                \
+    X(not, 0)                                                                  \
+    X(chartoint, 0)                                                            \
+    X(inttochar, 0)                                                            \
+    X(cjump, 1)                                                                \
+    X(branchiffalse, 1)                                                        \
+    X(branchifnotlt, 1)                                                        \
+    X(branchifnoteq, 1)                                                        \
+    X(branchifnotzero, 1)                                                      \
+    X(branchifnotnull, 1)                                                      \
+    X(get, 1)                                                                  \
+    X(fall, 1)                                                                 \
+    X(forget, 0)                                                               \
+    X(jump, 1)                                                                 \
+    X(cons, 0)                                                                 \
+    X(list, 1)                                                                 \
+    X(car, 0)                                                                  \
+    X(cdr, 0)                                                                  \
+    X(string, 1)                                                               \
+    X(stringlit, 1)                                                            \
+    X(stringref, 0)                                                            \
+    X(stringset, 0)                                                            \
+    X(stringappend, 1)                                                         \
+    X(vector, 1)                                                               \
+    X(vectorref, 0)                                                            \
+    X(vectorset, 0)                                                            \
+    X(vectorappend, 1)                                                         \
+    X(done, 0)                                                                 \
+    FUSED_OPCODES(X)                                                           \
+    GENERATED_OPCODES(X)
+
+// The hand-written superinstructions
+#define FUSED_OPCODES(X)                                                       \
+    X(getgetadd, 2)                                                            \
+    X(getcar, 1)                                                               \
+    X(loadnullcons, 0)                                                         \
+    X(forgetload, 1)                                                           \
+    X(forgetget, 1)
@@ -0,0 +1,47 @@
+#include "output.h"
+#include "libc.h"
+
+#define OUTPUT_BUFFER_SIZE 0x10000
+
+static uint8_t buffer[OUTPUT_BUFFER_SIZE];
+static size_t buffered;
+
+static void write_all_or_die(uint8_t const *buf, size_t len) {
+    while (len > 0) {
+        ssize_t const write_rc = write(STDOUT_FILENO, buf, len);
+        if (write_rc <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        buf += write_rc;
+        len -= write_rc;
+    }
+}
+
+void output_flush(void) {
+    write_all_or_die(buffer, buffered);
+    buffered = 0;
+}
+
+void output_bytes(void const *const buf, size_t const len) {
+    if (len > OUTPUT_BUFFER_SIZE - buffered) {
+        output_flush();
+        // Too big to be worth copying
+        if (len >= OUTPUT_BUFFER_SIZE) {
+            write_all_or_die(buf, len);
+            return;
+        }
+    }
+    uint8_t const *const bytes = buf;
+    for (size_t i = 0; i < len; i++) {
+        buffer[buffered + i] = bytes[i];
+    }
+    buffered += len;
+}
+
+void output_char(char const c) {
+    if (buffered == OUTPUT_BUFFER_SIZE) {
+        output_flush();
+    }
+    buffer[buffered] = c;
+    buffered++;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "libc.h"
+
+// Buffered writes to stdout. Nothing reaches stdout until the buffer fills or
+// output_flush is called, so flush before exiting.
+void output_bytes(void const *buf, size_t len);
+
+void output_char(char c);
+
+void output_flush(void);
+
+#define OUTPUT_STRING_LITERAL(S) output_bytes(S, sizeof(S) - 1)
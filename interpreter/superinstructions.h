@@ -0,0 +1,9 @@
+#pragma once
+
+// Generated by assembler/superinstructions.py.
+
+// X(name, number of immediates), as in opcodes.h
+#define GENERATED_OPCODES(X)
+
+// X(name, the opcode of each handler it fuses...)
+#define GENERATED_SEQUENCES(X)
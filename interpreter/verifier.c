@@ -0,0 +1,672 @@
+#include "verifier.h"
+#include "constants.h"
+#include "libc.h"
+#include "opcodes.h"
+
+// The verifier interprets the program abstractly: instead of values, it tracks
+// how deep the VM stack is and what type each slot holds. Each jump target
+// remembers the state that every path into it agrees on. Passes over the
+// program repeat until no backward jump changes a target's state, and the last
+// pass decides which instructions get unchecked handlers.
+
+#define VERIFIER_RESERVATION 0x40000000
+
+#define DECLARE_HANDLER(NAME, IMMEDIATES)                                      \
+    extern uint8_t const NAME[];                                               \
+    extern uint8_t const NAME##_unchecked[];
+OPCODES(DECLARE_HANDLER)
+#undef DECLARE_HANDLER
+
+enum opcode {
+#define OPCODE_ENUM(NAME, IMMEDIATES) OPCODE_##NAME,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+        OPCODE_COUNT
+};
+
+static uint8_t const *const checked_handlers[OPCODE_COUNT] = {
+#define CHECKED_HANDLER(NAME, IMMEDIATES) NAME,
+    OPCODES(CHECKED_HANDLER)
+#undef CHECKED_HANDLER
+};
+
+static uint8_t const *const unchecked_handlers[OPCODE_COUNT] = {
+#define UNCHECKED_HANDLER(NAME, IMMEDIATES) NAME##_unchecked,
+    OPCODES(UNCHECKED_HANDLER)
+#undef UNCHECKED_HANDLER
+};
+
+static uint8_t const immediate_count[OPCODE_COUNT] = {
+#define IMMEDIATE_COUNT(NAME, IMMEDIATES) IMMEDIATES,
+    OPCODES(IMMEDIATE_COUNT)
+#undef IMMEDIATE_COUNT
+};
+
+// TYPE_ANY is the only type that can't be relied on. Two paths that disagree
+// on a slot's type merge to TYPE_ANY.
+enum type {
+    TYPE_ANY,
+    TYPE_INT,
+    TYPE_BOOL,
+    TYPE_CHAR,
+    TYPE_NULL,
+    TYPE_PAIR,
+    TYPE_STRING,
+    TYPE_VECTOR,
+    TYPE_UNSPECIFIED,
+};
+
+// types[0] is the bottom of the stack. types is NULL until some path reaches
+// the instruction that the state belongs to.
+struct state {
+    uint64_t depth;
+    uint8_t *types;
+};
+
+struct verifier {
+    uint8_t *arena;
+    size_t arena_used;
+
+    // The program, as the 64-bit words that opcodes and immediates take up
+    uint64_t *words;
+    uint64_t word_count;
+    // The data section follows the code, at words[word_count]
+    uint64_t data_word_count;
+
+    // Filled in by decode. Instruction i starts at words[starts[i]], and
+    // starts[instruction_count] is word_count. index_at maps the start of
+    // each instruction back to its index, and every other word to NOT_START.
+    uint64_t instruction_count;
+    uint64_t *starts;
+    uint64_t *index_at;
+    uint8_t *opcodes;
+    // Only the first immediate. The second, if any, is right after it.
+    uint64_t *immediates;
+
+    // Only jump targets have a state here.
+    struct state *targets;
+
+    // The state just before the instruction being verified.
+    struct state current;
+    // Pushing past capacity fails verification. It's max_depth, unless the
+    // program is too short to get that deep.
+    uint64_t capacity;
+    uint64_t max_depth;
+
+    // Whether each instruction can use its _unchecked handler.
+    bool *unchecked;
+
+    // Set when a backward jump changes the state of its target, which means
+    // another pass is needed.
+    bool changed;
+};
+
+static void *allocate(struct verifier *const v, size_t const size) {
+    size_t const aligned_size = (size + 7) & -8ull;
+    if (aligned_size > VERIFIER_RESERVATION - v->arena_used) {
+        return NULL;
+    }
+    void *const result = v->arena + v->arena_used;
+    v->arena_used += aligned_size;
+    return result;
+}
+
+#define NOT_START (-1ull)
+
+static bool decode(struct verifier *const v) {
+    for (uint64_t w = 0; w < v->word_count; w++) {
+        v->index_at[w] = NOT_START;
+    }
+    uint64_t i = 0;
+    uint64_t w = 0;
+    while (w < v->word_count) {
+        uint64_t op = 0;
+        while (op < OPCODE_COUNT &&
+               (uint64_t)checked_handlers[op] != v->words[w]) {
+            op++;
+        }
+        if (op == OPCODE_COUNT) {
+            return false;
+        }
+        v->starts[i] = w;
+        v->index_at[w] = i;
+        v->opcodes[i] = op;
+        w++;
+        if (immediate_count[op] > v->word_count - w) {
+            return false;
+        }
+        if (immediate_count[op] > 0) {
+            v->immediates[i] = v->words[w];
+        }
+        w += immediate_count[op];
+        i++;
+    }
+    v->starts[i] = w;
+    v->instruction_count = i;
+    return true;
+}
+
+static enum type immediate_type(uint64_t const immediate) {
+    if ((immediate & INT_MASK) == INT_SUFFIX) {
+        return TYPE_INT;
+    }
+    if (immediate == TRUE || immediate == FALSE) {
+        return TYPE_BOOL;
+    }
+    if (TAGGED_CHAR_MIN <= immediate && immediate <= TAGGED_CHAR_MAX &&
+        (immediate & CHAR_MASK) == CHAR_SUFFIX) {
+        return TYPE_CHAR;
+    }
+    if (immediate == TAGGED_NULL) {
+        return TYPE_NULL;
+    }
+    if (immediate == UNSPECIFIED) {
+        return TYPE_UNSPECIFIED;
+    }
+    return TYPE_ANY;
+}
+
+// Pops one slot. If it isn't known to have the expected type, the current
+// instruction has to keep its checks.
+static bool pop(struct verifier *const v, enum type const expected,
+                bool *const proven) {
+    if (v->current.depth == 0) {
+        return false;
+    }
+    v->current.depth--;
+    if (expected != TYPE_ANY &&
+        v->current.types[v->current.depth] != expected) {
+        *proven = false;
+    }
+    return true;
+}
+
+static bool pop_n(struct verifier *const v, uint64_t const n,
+                  enum type const expected, bool *const proven) {
+    if (n > v->current.depth) {
+        return false;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        pop(v, expected, proven);
+    }
+    return true;
+}
+
+static bool push(struct verifier *const v, enum type const type) {
+    if (v->current.depth == v->capacity) {
+        return false;
+    }
+    v->current.types[v->current.depth] = type;
+    v->current.depth++;
+    return true;
+}
+
+// Merges state into target. Returns false if the two can't be reconciled.
+static bool merge(struct verifier *const v, struct state *const target,
+                  struct state const *const state, bool *const widened) {
+    *widened = false;
+    if (target->types == NULL) {
+        target->types = allocate(v, state->depth);
+        if (target->types == NULL) {
+            return false;
+        }
+        target->depth = state->depth;
+        for (uint64_t i = 0; i < state->depth; i++) {
+            target->types[i] = state->types[i];
+        }
+        *widened = true;
+        return true;
+    }
+    if (target->depth != state->depth) {
+        return false;
+    }
+    for (uint64_t i = 0; i < state->depth; i++) {
+        if (target->types[i] != TYPE_ANY &&
+            target->types[i] != state->types[i]) {
+            target->types[i] = TYPE_ANY;
+            *widened = true;
+        }
+    }
+    return true;
+}
+
+static bool jump_to(struct verifier *const v, uint64_t const from,
+                    uint64_t const offset) {
+    // Offsets are in bytes, relative to the next instruction.
+    if ((int64_t)offset % OPCODE_SIZE != 0) {
+        return false;
+    }
+    int64_t const target_word =
+        (int64_t)v->starts[from + 1] + (int64_t)offset / OPCODE_SIZE;
+    if (target_word < 0 || (uint64_t)target_word >= v->word_count ||
+        v->index_at[target_word] == NOT_START) {
+        return false;
+    }
+    uint64_t const target = v->index_at[target_word];
+    bool widened;
+    if (!merge(v, &v->targets[target], &v->current, &widened)) {
+        return false;
+    }
+    if (widened && target <= from) {
+        v->changed = true;
+    }
+    return true;
+}
+
+// Whether offset (in bytes, relative to the instruction after i, like a jump's)
+// points at a whole string in the data section.
+static bool is_string_constant(struct verifier const *const v,
+                               uint64_t const i, uint64_t const offset) {
+    if ((int64_t)offset % OPCODE_SIZE != 0) {
+        return false;
+    }
+    int64_t const word =
+        (int64_t)v->starts[i + 1] + (int64_t)offset / OPCODE_SIZE;
+    uint64_t const end = v->word_count + v->data_word_count;
+    if (word < (int64_t)v->word_count || (uint64_t)word >= end) {
+        return false;
+    }
+    uint64_t const header = v->words[word];
+    if ((header & STRING_HEADER_MASK) != STRING_HEADER_SUFFIX) {
+        return false;
+    }
+    uint64_t const body_words = ((header >> HEADER_LENGTH_SHIFT) + 7) / 8;
+    return body_words < end - (uint64_t)word;
+}
+
+static bool apply(struct verifier *v, uint64_t i, enum opcode op,
+                  uint64_t immediate, bool *proven, bool *falls_through);
+
+// Applies each opcode in sequence in turn, as the superinstruction at i that
+// fuses them. Its immediates are theirs, in order.
+// Unused until superinstructions.py has generated some.
+[[maybe_unused]]
+static bool apply_sequence(struct verifier *const v, uint64_t const i,
+                           uint8_t const *const sequence, size_t const length,
+                           bool *const proven, bool *const falls_through) {
+    uint64_t const *immediates = &v->words[v->starts[i] + 1];
+    for (size_t j = 0; j < length; j++) {
+        uint64_t const immediate =
+            immediate_count[sequence[j]] > 0 ? immediates[0] : 0;
+        immediates += immediate_count[sequence[j]];
+        if (!apply(v, i, sequence[j], immediate, proven, falls_through)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Applies op, the opcode of instruction i, to the current state. Clears
+// *proven if the instruction needs its checks, and *falls_through if the next
+// instruction can't run after this one.
+static bool apply(struct verifier *const v, uint64_t const i,
+                  enum opcode const op, uint64_t const immediate,
+                  bool *const proven, bool *const falls_through) {
+    switch (op) {
+    case OPCODE_add1:
+    case OPCODE_sub1:
+        if (!pop(v, TYPE_INT, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    case OPCODE_sub:
+        if (immediate == 0) {
+            return false; // (-) always traps
+        }
+        [[fallthrough]];
+    case OPCODE_add:
+    case OPCODE_mul:
+        if (!pop_n(v, immediate, TYPE_INT, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    case OPCODE_lt:
+    case OPCODE_eq:
+        if (!pop_n(v, immediate, TYPE_INT, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_add2:
+    case OPCODE_sub2:
+    case OPCODE_mul2:
+        if (!pop_n(v, 2, TYPE_INT, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    case OPCODE_lt2:
+    case OPCODE_eq2:
+        if (!pop_n(v, 2, TYPE_INT, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_eqp2:
+        if (!pop_n(v, 2, TYPE_ANY, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    // The immediate is checked like a second argument
+    case OPCODE_addi:
+    case OPCODE_subi:
+    case OPCODE_muli:
+        if (!push(v, immediate_type(immediate)) ||
+            !pop_n(v, 2, TYPE_INT, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    case OPCODE_lti:
+    case OPCODE_eqi:
+        if (!push(v, immediate_type(immediate)) ||
+            !pop_n(v, 2, TYPE_INT, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_eqp:
+        if (!pop_n(v, immediate, TYPE_ANY, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_load:
+        if (!push(v, immediate_type(immediate))) {
+            return false;
+        }
+        break;
+    case OPCODE_zerop:
+        if (!pop(v, TYPE_INT, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_integerp:
+    case OPCODE_booleanp:
+    case OPCODE_charp:
+    case OPCODE_nullp:
+    case OPCODE_not:
+        if (!pop(v, TYPE_ANY, proven) || !push(v, TYPE_BOOL)) {
+            return false;
+        }
+        break;
+    case OPCODE_chartoint:
+        if (!pop(v, TYPE_CHAR, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    case OPCODE_inttochar:
+        if (!pop(v, TYPE_INT, proven) || !push(v, TYPE_CHAR)) {
+            return false;
+        }
+        break;
+    case OPCODE_cjump:
+        if (!pop(v, TYPE_BOOL, proven) || !jump_to(v, i, immediate)) {
+            return false;
+        }
+        break;
+    case OPCODE_branchiffalse:
+    case OPCODE_branchifnotnull:
+        if (!pop(v, TYPE_ANY, proven) || !jump_to(v, i, immediate)) {
+            return false;
+        }
+        break;
+    case OPCODE_branchifnotlt:
+    case OPCODE_branchifnoteq:
+        if (!pop_n(v, 2, TYPE_INT, proven) || !jump_to(v, i, immediate)) {
+            return false;
+        }
+        break;
+    case OPCODE_branchifnotzero:
+        if (!pop(v, TYPE_INT, proven) || !jump_to(v, i, immediate)) {
+            return false;
+        }
+        break;
+    case OPCODE_get:
+        if (immediate >= v->current.depth ||
+            !push(v, v->current.types[immediate])) {
+            return false;
+        }
+        break;
+    case OPCODE_fall: {
+        if (immediate >= v->current.depth) {
+            return false;
+        }
+        uint8_t const top = v->current.types[v->current.depth - 1];
+        v->current.depth -= immediate;
+        v->current.types[v->current.depth - 1] = top;
+        break;
+    }
+    case OPCODE_forget:
+        if (!pop(v, TYPE_ANY, proven)) {
+            return false;
+        }
+        break;
+    case OPCODE_jump:
+        if (!jump_to(v, i, immediate)) {
+            return false;
+        }
+        *falls_through = false;
+        break;
+    case OPCODE_cons:
+        if (!pop_n(v, 2, TYPE_ANY, proven) || !push(v, TYPE_PAIR)) {
+            return false;
+        }
+        break;
+    case OPCODE_list:
+        if (!pop_n(v, immediate, TYPE_ANY, proven) ||
+            !push(v, immediate == 0 ? TYPE_NULL : TYPE_PAIR)) {
+            return false;
+        }
+        break;
+    case OPCODE_car:
+    case OPCODE_cdr:
+        if (!pop(v, TYPE_PAIR, proven) || !push(v, TYPE_ANY)) {
+            return false;
+        }
+        break;
+    case OPCODE_string:
+        if (!pop_n(v, immediate, TYPE_CHAR, proven) ||
+            !push(v, TYPE_STRING)) {
+            return false;
+        }
+        break;
+    case OPCODE_stringlit:
+        if (!is_string_constant(v, i, immediate) || !push(v, TYPE_STRING)) {
+            return false;
+        }
+        break;
+    case OPCODE_stringref:
+        if (!pop(v, TYPE_INT, proven) || !pop(v, TYPE_STRING, proven) ||
+            !push(v, TYPE_CHAR)) {
+            return false;
+        }
+        break;
+    case OPCODE_stringset:
+        if (!pop(v, TYPE_CHAR, proven) || !pop(v, TYPE_INT, proven) ||
+            !pop(v, TYPE_STRING, proven) || !push(v, TYPE_UNSPECIFIED)) {
+            return false;
+        }
+        break;
+    case OPCODE_stringappend:
+        if (!pop_n(v, immediate, TYPE_STRING, proven) ||
+            !push(v, TYPE_STRING)) {
+            return false;
+        }
+        break;
+    case OPCODE_vector:
+        if (!pop_n(v, immediate, TYPE_ANY, proven) ||
+            !push(v, TYPE_VECTOR)) {
+            return false;
+        }
+        break;
+    case OPCODE_vectorref:
+        if (!pop(v, TYPE_INT, proven) || !pop(v, TYPE_VECTOR, proven) ||
+            !push(v, TYPE_ANY)) {
+            return false;
+        }
+        break;
+    case OPCODE_vectorset:
+        if (!pop(v, TYPE_ANY, proven) || !pop(v, TYPE_INT, proven) ||
+            !pop(v, TYPE_VECTOR, proven) || !push(v, TYPE_UNSPECIFIED)) {
+            return false;
+        }
+        break;
+    case OPCODE_vectorappend:
+        if (!pop_n(v, immediate, TYPE_VECTOR, proven) ||
+            !push(v, TYPE_VECTOR)) {
+            return false;
+        }
+        break;
+    // Superinstructions do what their sequences would, one step at a time.
+    case OPCODE_getgetadd: {
+        uint64_t const second = v->words[v->starts[i] + 2];
+        if (immediate >= v->current.depth ||
+            !push(v, v->current.types[immediate]) ||
+            second >= v->current.depth ||
+            !push(v, v->current.types[second]) ||
+            !pop_n(v, 2, TYPE_INT, proven) || !push(v, TYPE_INT)) {
+            return false;
+        }
+        break;
+    }
+    case OPCODE_getcar:
+        if (immediate >= v->current.depth ||
+            !push(v, v->current.types[immediate]) ||
+            !pop(v, TYPE_PAIR, proven) || !push(v, TYPE_ANY)) {
+            return false;
+        }
+        break;
+    case OPCODE_loadnullcons:
+        if (!push(v, TYPE_NULL) || !pop_n(v, 2, TYPE_ANY, proven) ||
+            !push(v, TYPE_PAIR)) {
+            return false;
+        }
+        break;
+    case OPCODE_forgetload:
+        if (!pop(v, TYPE_ANY, proven) ||
+            !push(v, immediate_type(immediate))) {
+            return false;
+        }
+        break;
+    case OPCODE_forgetget:
+        if (!pop(v, TYPE_ANY, proven) || immediate >= v->current.depth ||
+            !push(v, v->current.types[immediate])) {
+            return false;
+        }
+        break;
+    case OPCODE_done:
+        if (v->current.depth > 1) {
+            return false; // always traps
+        }
+        *falls_through = false;
+        break;
+#define GENERATED_CASE(NAME, ...)                                              \
+    case OPCODE_##NAME: {                                                      \
+        static uint8_t const sequence[] = {__VA_ARGS__};                       \
+        return apply_sequence(v, i, sequence, sizeof(sequence), proven,        \
+                              falls_through);                                  \
+    }
+        GENERATED_SEQUENCES(GENERATED_CASE)
+#undef GENERATED_CASE
+    case OPCODE_COUNT:
+        return false;
+    }
+    return true;
+}
+
+// Applies instruction i to the current state. Sets *falls_through to whether
+// the next instruction can run after this one.
+static bool step(struct verifier *const v, uint64_t const i,
+                 bool *const falls_through) {
+    bool proven = true;
+    *falls_through = true;
+    if (!apply(v, i, v->opcodes[i], v->immediates[i], &proven,
+               falls_through)) {
+        return false;
+    }
+    v->unchecked[i] = proven;
+    return true;
+}
+
+
+static bool verify_pass(struct verifier *const v) {
+    v->changed = false;
+    bool reachable = true; // execution starts at the first instruction
+    v->current.depth = 0;
+    for (uint64_t i = 0; i < v->instruction_count; i++) {
+        v->unchecked[i] = false;
+        struct state *const target = &v->targets[i];
+        if (target->types != NULL) {
+            bool widened;
+            if (reachable && !merge(v, target, &v->current, &widened)) {
+                return false;
+            }
+            v->current.depth = target->depth;
+            for (uint64_t j = 0; j < target->depth; j++) {
+                v->current.types[j] = target->types[j];
+            }
+            reachable = true;
+        }
+        if (!reachable) {
+            continue;
+        }
+        if (!step(v, i, &reachable)) {
+            return false;
+        }
+    }
+    // Falling off the end of the program
+    return !reachable;
+}
+
+static bool run(struct verifier *const v) {
+    // There can't be more instructions than words.
+    uint64_t const n = v->word_count;
+    v->starts = allocate(v, (n + 1) * sizeof(uint64_t));
+    v->index_at = allocate(v, n * sizeof(uint64_t));
+    v->opcodes = allocate(v, n);
+    v->immediates = allocate(v, n * sizeof(uint64_t));
+    v->unchecked = allocate(v, n * sizeof(bool));
+    v->targets = allocate(v, n * sizeof(struct state));
+    v->capacity = n + 1 < v->max_depth ? n + 1 : v->max_depth;
+    v->current.types = allocate(v, v->capacity);
+    if (v->starts == NULL || v->index_at == NULL || v->opcodes == NULL ||
+        v->immediates == NULL || v->unchecked == NULL || v->targets == NULL ||
+        v->current.types == NULL) {
+        return false;
+    }
+    if (!decode(v)) {
+        return false;
+    }
+    do {
+        if (!verify_pass(v)) {
+            return false;
+        }
+    } while (v->changed);
+    return true;
+}
+
+void verify(void *const bytecode, size_t const size, size_t const data_size,
+            uint64_t const max_depth) {
+    if (size == 0 || size % OPCODE_SIZE != 0 || data_size % OPCODE_SIZE != 0) {
+        return;
+    }
+    void *const arena =
+        mmap(NULL, VERIFIER_RESERVATION, PROT_READ | PROT_WRITE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (arena <= NULL) {
+        return;
+    }
+
+    struct verifier v = {
+        .arena = arena,
+        .words = bytecode,
+        .word_count = size / OPCODE_SIZE,
+        .data_word_count = data_size / OPCODE_SIZE,
+        .max_depth = max_depth,
+    };
+    if (run(&v)) {
+        for (uint64_t i = 0; i < v.instruction_count; i++) {
+            if (v.unchecked[i]) {
+                v.words[v.starts[i]] =
+                    (uint64_t)unchecked_handlers[v.opcodes[i]];
+            }
+        }
+    }
+
+    munmap(arena, VERIFIER_RESERVATION);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "libc.h"
+
+// Tries to prove that the program in bytecode can never underflow the VM
+// stack or grow it past max_depth slots, never jumps outside of itself, only
+// refers to whole constants in the data_size bytes of data that follow it, and
+// (where it can) that every operand has the type its instruction expects.
+// Each instruction whose checks are proven redundant is rewritten in place to
+// use its _unchecked handler.
+// If the program can't be verified, it's left alone.
+void verify(void *bytecode, size_t size, size_t data_size, uint64_t max_depth);
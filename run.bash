@@ -2,4 +2,4 @@
 
 set -euo pipefail
 
-./compiler/target/debug/compiler | uv run ./assembler/main.py | ./interpreter/interpreter
+./compiler/target/debug/compiler --emit=bytecode | ./interpreter/interpreter
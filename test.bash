@@ -10,7 +10,10 @@ popd &>/dev/null
 
 for t in tests/*; do
     printf '%s ... ' "$t"
-    if diff <(./run.bash < "$t/in") "$t/out"; then
+    # The compiler's bytecode backend has to agree with the text assembler
+    if diff <(./run.bash < "$t/in") "$t/out" &&
+        cmp <(./compiler/target/debug/compiler --emit=bytecode < "$t/in") \
+            <(./compiler/target/debug/compiler < "$t/in" | uv run ./assembler/main.py); then
         printf '\x1b[32mok'
     else
         printf '\x1b[31mfail'